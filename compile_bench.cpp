@@ -0,0 +1,76 @@
+/*
+ * compile time benchmark for luamm.hpp
+ *
+ * this translation unit instantiates the binding machinery the way a
+ * typical module does: free functions and lambdas of various arities,
+ * multiple return values, class bindings and calls into lua. Build it
+ * with `make compile-bench` to measure the cost of including luamm.
+ */
+
+#include "luamm.hpp"
+#include <string>
+#include <tuple>
+
+using namespace luamm;
+
+namespace {
+    struct Point {
+        Number x, y;
+        Point(Number x, Number y) : x(x), y(y) {}
+        Number dot(Number a, Number b) { return x*a + y*b; }
+        void move(Number dx, Number dy) { x += dx; y += dy; }
+        Number norm() const { return x*x + y*y; }
+    };
+
+    Number add3(Number a, Number b, Number c) { return a + b + c; }
+
+    std::string join(State&, const char* a, std::string&& b) {
+        return std::string(a) + b;
+    }
+
+    Table bind(State& st) {
+        Table mod = st.newTable();
+        mod["add3"] = st.newCallable(add3);
+        mod["join"] = st.newCallable(join);
+        mod["f1"] = st.newCallable([](Number a) { return a; });
+        mod["f2"] = st.newCallable([](Number a, Number b) {
+            return std::make_tuple(b, a);
+        });
+        mod["f4"] = st.newCallable([](Number a, Number b, Number c, Number d) {
+            return std::make_tuple(d, c, b, a);
+        });
+        mod["f8"] = st.newCallable([](Number a, Number b, Number c, Number d,
+                                      Number e, Number f, Number g, Number h) {
+            return a + b + c + d + e + f + g + h;
+        });
+        mod["tab"] = st.newCallable([](Table&& t, const char* k) -> Number {
+            return t[k];
+        });
+        mod["opt"] = st.newCallable([](Number a, Optional<Number> b) {
+            return a + b.value_or(0);
+        });
+        mod["point"] = Table(std::move(
+            st.class_<Point>("point")
+            .def("dot", &Point::dot)
+            .def("move", &Point::move)
+            .def("norm", &Point::norm)
+            .attribute("x", &Point::x)
+            .attribute("y", &Point::y)
+            .init<Number, Number>()
+        ));
+        return mod;
+    }
+}
+
+int main()
+{
+    NewState st;
+    st["bench"] = bind(st);
+    Closure f = st.newFunc("return 1, 2, 3, 4, 5, 6, 7, 8");
+    {
+        auto scope = st.newScope();
+        std::tuple<int, int, int, int, int, int, int, int> r = f();
+        (void)r;
+    }
+    return 0;
+}
@@ -209,6 +209,7 @@ namespace metatable {
     Table path(State& st)
     {
         Table mtab = st.newTable();
+        mtab["__gc"] = CClosure(st.userDataGC<fs::path>());
         mtab["__tostring"] = st.newCallable(path_tostring);
         mtab["__index"] = mtab;
         mtab["__concat"] = st.newCallable(path_concat);
@@ -278,6 +279,7 @@ namespace metatable {
     Table file_status(State& st)
     {
         Table mtab = st.newTable();
+        mtab["__gc"] = CClosure(st.userDataGC<fs::file_status>());
         mtab["__index"] = mtab;
         mtab["typeid"] = st.newCallable(file_status_type);
         mtab["type"] = st.newCallable(file_status_typename);
@@ -320,13 +322,18 @@ Table reg(State& st)
 LUAMM_MODULE(fs, L)
 {
     State st(L);
+    st.allocate(1); // allocate return value
 
-    const char *modname = st[1];
-    const char *modfile = st[2];
+    // require passes the file the module came from, State::lazy and
+    // package.preload only the name
+    std::string modname = st[2];
+    std::string modfile = st[3].isstr() ? st[3] : std::string();
 
     Table mod = reg(st);
     mod["modname"] = modname;
-    mod["modfile"] = modfile;
+    if (!modfile.empty()) {
+        mod["modfile"] = modfile;
+    }
 
     st[1] = mod;
     st.settop(1);
@@ -23,8 +23,9 @@ extern "C" int luaopen_hello(lua_State *L) {
     State st(L);
     st.allocate(1); // allocate return value
 
-    const char *modname = st[2];
-    const char *modfile = st[3];
+    // no file when loaded by State::lazy or from package.preload
+    std::string modname = st[2];
+    std::string modfile = st[3].isstr() ? st[3] : std::string("preload");
 
     Table mod = reg(st);
     cerr << "load " << modname << " from " << modfile << endl;
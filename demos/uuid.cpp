@@ -7,37 +7,37 @@
 using namespace boost::uuids;
 using namespace luamm;
 
-static std::string uuid_registry_key;
-
+typedef basic_random_generator<boost::mt19937> generator;
 
+// a uuid returned to lua is constructed in place in an object of the
+// bound class "uuid", without an intermediate userdata
+namespace luamm {
 template<>
 struct VarProxy<uuid> : VarBase {
     bool push(const uuid& u) {
-        State st(state);
-        UserData ud = st.newUserData<uuid>(std::move(u));
-        ud.set(uuid_registry_key);
-        ud.index = 0;
+        detail::newClassObject<uuid>(state, u);
         return true;
     }
 };
+}
 
 LUAMM_MODULE(uuid, L)
 {
     State state(L);
 
-    // uuid
-    auto uuid_mod = std::move(
+    // registers the metatable used by VarProxy<uuid>
+    Table uuid_class = std::move(
         state.class_<uuid>("uuid")
             .def("size", &uuid::size)
-            .def("__tostring", [](UserData&& self) {
-                return to_string(self.to<uuid>());
+            .def("__tostring", [](const uuid& self) {
+                return to_string(self);
             })
     );
-    uuid_registry_key = uuid_mod.uuid;
 
-    auto c = state.class_<basic_random_generator<boost::mt19937>>("random_generator");
-    c.def("__call", &basic_random_generator<boost::mt19937>::operator());
-    c.init();
-    Table mod = std::move(c);
+    Table mod = std::move(
+        state.class_<generator>("random_generator")
+            .def("__call", &generator::operator())
+            .init()
+    );
     LUAMM_MODULE_RETURN(state, mod);
 }
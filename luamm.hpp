@@ -25,21 +25,29 @@
 #include <lua.hpp>
 #include <assert.h>
 #include <ctype.h>
+#include <climits>
 #include <cstdint>
+#include <cstring>
 
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <iterator>
 #include <stdexcept>
 #include <string>
+#include <map>
+#include <sstream>
+#include <memory>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#ifdef LUAMM_CALL_STATS
+#include <algorithm>
+#include <mutex>
+#endif
 
-#include <boost/function_types/parameter_types.hpp>
-#include <boost/function_types/result_type.hpp>
-#include <boost/mpl/pair.hpp>
-#include <boost/mpl/fold.hpp>
-#include <boost/mpl/size.hpp>
-#include <boost/mpl/vector.hpp>
-#include <boost/preprocessor.hpp>
 
 namespace luamm {
 
@@ -83,6 +91,57 @@ namespace luamm {
                 }
             }
         };
+
+        /* compile time list of types */
+        template<typename... T>
+        struct TypeList {};
+
+        template<typename List>
+        struct Front;
+
+        template<typename T, typename... Ts>
+        struct Front<TypeList<T, Ts...>> { typedef T type; };
+
+        template<>
+        struct Front<TypeList<>> { typedef void type; };
+
+        template<typename List>
+        struct PopFront;
+
+        template<typename T, typename... Ts>
+        struct PopFront<TypeList<T, Ts...>> { typedef TypeList<Ts...> type; };
+
+        template<typename First, typename Second>
+        struct Pair {
+            typedef First first;
+            typedef Second second;
+        };
+
+        /* result and parameter types of a function or member function,
+         * the parameter list of a member function starts with Class& */
+        template<typename F>
+        struct FunctionTraits;
+
+        template<typename R, typename... Args>
+        struct FunctionTraits<R(Args...)> {
+            typedef R result_t;
+            typedef TypeList<Args...> para_t;
+        };
+
+        template<typename R, typename... Args>
+        struct FunctionTraits<R(*)(Args...)> : FunctionTraits<R(Args...)> {};
+
+        template<typename R, typename C, typename... Args>
+        struct FunctionTraits<R(C::*)(Args...)> {
+            typedef R result_t;
+            typedef TypeList<C&, Args...> para_t;
+        };
+
+        template<typename R, typename C, typename... Args>
+        struct FunctionTraits<R(C::*)(Args...) const> {
+            typedef R result_t;
+            typedef TypeList<const C&, Args...> para_t;
+        };
     }
 
 
@@ -99,11 +158,160 @@ struct RuntimeError : std::runtime_error {
     RuntimeError() : std::runtime_error("") {}
 };
 
+/* raised by a call which ran out of its execution budget */
+struct BudgetExceeded : RuntimeError {
+    enum Reason { Instructions, Deadline };
+    Reason reason;
+    BudgetExceeded(Reason r, const std::string& s) : RuntimeError(s), reason(r) {}
+};
+
+/* limits lua code executed on a state while the budget is alive, to a
+ * number of vm instructions and/or a wall clock timeout (zero: unlimited).
+ * A count hook checks both every `granularity` instructions and raises a
+ * lua error, which escapes any pcall inside the script since the hook keeps
+ * failing; the call then throws BudgetExceeded. The state stays usable, the
+ * previous hook and budget are restored on destruction.
+ *
+ *     {
+ *         Budget budget(lua.ptr(), 1000000, std::chrono::milliseconds(10));
+ *         script();
+ *     }
+ */
+class Budget {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    Budget(lua_State* st, long instructions,
+           std::chrono::microseconds timeout = std::chrono::microseconds(0),
+           int granularity = 1000)
+        : state(st), remaining(instructions), limited(instructions > 0),
+          timed(timeout.count() > 0), deadline(clock::now() + timeout),
+          granularity(granularity), tripped(false),
+          reason(BudgetExceeded::Instructions),
+          prevhook(lua_gethook(st)), prevmask(lua_gethookmask(st)),
+          prevcount(lua_gethookcount(st)) {
+        if (limited && remaining < granularity) {
+            this->granularity = static_cast<int>(remaining);
+        }
+        lua_rawgetp(st, LUA_REGISTRYINDEX, key());
+        outer = static_cast<Budget*>(lua_touserdata(st, -1));
+        lua_pop(st, 1);
+        // nested budgets are all charged, a foreign hook keeps running
+        forward = prevhook;
+        forwardmask = prevmask;
+        if (outer && prevhook == &Budget::hook) {
+            forward = outer->forward;
+            forwardmask = outer->forwardmask;
+        }
+        lua_pushlightuserdata(st, this);
+        lua_rawsetp(st, LUA_REGISTRYINDEX, key());
+        lua_sethook(st, &Budget::hook, prevmask | LUA_MASKCOUNT,
+                    this->granularity);
+    }
+
+    ~Budget() {
+        lua_sethook(state, prevhook, prevmask, prevcount);
+        lua_pushlightuserdata(state, outer);
+        lua_rawsetp(state, LUA_REGISTRYINDEX, key());
+    }
+
+    Budget(const Budget&) = delete;
+
+    bool exceeded() const { return tripped; }
+
+    // instructions left, approximated to the granularity
+    long left() const { return remaining; }
+
+    // the budget which stopped a failed call on st, if any
+    static const Budget* current(lua_State* st) {
+        lua_rawgetp(st, LUA_REGISTRYINDEX, key());
+        auto budget = static_cast<const Budget*>(lua_touserdata(st, -1));
+        lua_pop(st, 1);
+        return budget && budget->tripped ? budget : nullptr;
+    }
+
+    BudgetExceeded error() const {
+        return BudgetExceeded(reason, message());
+    }
+
+private:
+    lua_State* state;
+    long remaining;
+    bool limited, timed;
+    clock::time_point deadline;
+    int granularity;
+    bool tripped;
+    BudgetExceeded::Reason reason;
+    lua_Hook prevhook, forward;
+    int prevmask, prevcount, forwardmask;
+    Budget* outer;
+
+    static const void* key() {
+        static const char k = 0;
+        return &k;
+    }
+
+    const char* message() const {
+        return reason == BudgetExceeded::Instructions
+            ? "instruction budget exceeded" : "deadline exceeded";
+    }
+
+    static void hook(lua_State* st, lua_Debug* ar) {
+        lua_rawgetp(st, LUA_REGISTRYINDEX, key());
+        Budget* self = static_cast<Budget*>(lua_touserdata(st, -1));
+        lua_pop(st, 1);
+        if (!self) return;
+
+        // forward the events the previous hook asked for
+        int event = ar->event == LUA_HOOKTAILCALL ? LUA_HOOKCALL : ar->event;
+        if (self->forward && (self->forwardmask & (1 << event))) {
+            self->forward(st, ar);
+        }
+        if (ar->event != LUA_HOOKCOUNT) return;
+
+        const Budget* failed = nullptr;
+        for (Budget* b = self; b; b = b->outer) {
+            if (b->charge(self->granularity) && !failed) { failed = b; }
+        }
+        if (failed) {
+            // the innermost budget reports the failure
+            if (!self->tripped) {
+                self->tripped = true;
+                self->reason = failed->reason;
+            }
+            // fail on every instruction, so no pcall can recover
+            lua_sethook(st, &Budget::hook, lua_gethookmask(st), 1);
+            lua_pushstring(st, self->message());
+            lua_error(st);
+        }
+    }
+
+    // true once the budget is exhausted
+    bool charge(int instructions) {
+        if (tripped) return true;
+        if (limited) {
+            remaining -= instructions;
+            if (remaining <= 0) {
+                tripped = true;
+                reason = BudgetExceeded::Instructions;
+            }
+        }
+        if (!tripped && timed && clock::now() >= deadline) {
+            tripped = true;
+            reason = BudgetExceeded::Deadline;
+        }
+        return tripped;
+    }
+};
+
 /* defines a static member funcion push() for each type of variable
  * that permitted to be passed into lua runtime environmrnt */
 template<typename T>
 struct VarPusher;
 
+template<typename T>
+struct VarGetter;
+
 /* defines a static member function get() for read a lua variable
  * uniquely identified by key of type Key into elem of type Elem
  */
@@ -121,6 +329,15 @@ struct KeyTyper;
 template<typename LuaValue>
 struct VarProxy;
 
+namespace detail {
+    /* a unique_ptr given up by its owner, only made by moving the pointer
+     * into a Variant */
+    template<typename T, typename D>
+    struct UniqueTransfer {
+        std::unique_ptr<T, D>* ptr;
+    };
+}
+
 /* router class for read/write/update a lua variable */
 template<typename Container = lua_State*, typename Key = int>
 class Variant  {
@@ -155,6 +372,18 @@ public:
         return *this;
     }
 
+    // the ownership goes to lua, lvalues must be moved explicitly
+    template<typename T, typename D>
+    Variant& operator=(std::unique_ptr<T, D>&& p) {
+        return *this = detail::UniqueTransfer<T, D>{&p};
+    }
+
+    template<typename T, typename D>
+    Variant& operator=(std::unique_ptr<T, D>& p) = delete;
+
+    template<typename T, typename D>
+    Variant& operator=(const std::unique_ptr<T, D>& p) = delete;
+
     template<typename T>
     T convert(T* ) {
         return this->operator T();
@@ -251,6 +480,27 @@ public:
 };
 
 
+namespace detail {
+    template<typename T>
+    T* toClass(lua_State* st, int index);
+
+    // the alignment lua guarantees for the block of a userdata
+    union UserDataAlign { double d; void* p; long l; };
+    enum { userdata_align = alignof(UserDataAlign) };
+
+    // extra room for a T aligned beyond userdata_align inside the block
+    template<typename T>
+    struct AlignPad {
+        enum { value = alignof(T) > userdata_align
+                       ? alignof(T) - userdata_align : 0 };
+    };
+
+    inline void* alignUp(void* p, std::size_t align) {
+        std::uintptr_t u = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<void*>((u + align - 1) & ~(align - 1));
+    }
+}
+
 struct UserData : detail::HasMetaTable<UserData> {
     lua_State* state;
     int index;
@@ -262,16 +512,335 @@ struct UserData : detail::HasMetaTable<UserData> {
     }
     UserData(const UserData&) = delete;
 
+    // objects of a bound class are found through their tag, with the
+    // pointer adjusted when the userdata holds a class derived from T
     template<typename T>
     T& to() {
+        if (T* obj = detail::toClass<T>(state, index)) {
+            return *obj;
+        }
         void *p = lua_touserdata(state, index);
-        return *static_cast<T*>(p);
+        return *static_cast<T*>(detail::alignUp(p, alignof(T)));
     }
     ~UserData();
 };
 
 namespace detail {template<>struct StackVariable<UserData> { enum{value=1};};}
 
+namespace detail {
+    typedef void* (*Upcast)(void*);
+
+    struct ClassInfo;
+
+    /* a base or a derived class of a bound class, path holds the casts
+     * from the derived object up to the base, nearest base first */
+    struct ClassCast {
+        const void* cls;
+        ClassInfo* info;
+        std::vector<Upcast> path;
+
+        void* apply(void* p) const {
+            for (Upcast f : path) { p = f(p); }
+            return p;
+        }
+    };
+
+    /* the cast table of a bound class, filled when a class_<Derived, Base>
+     * is registered. Like the class names, it is shared by every state.
+     * The lists only grow, by atomic pushes of nodes that are never
+     * freed, so toClass can walk them while another thread binds. */
+    struct ClassCastNode {
+        ClassCast cast;
+        const ClassCastNode* next;
+    };
+
+    struct ClassCastList {
+        std::atomic<const ClassCastNode*> head;
+
+        ClassCastList() : head(nullptr) {}
+
+        const ClassCastNode* first() const {
+            return head.load(std::memory_order_acquire);
+        }
+
+        void push(const ClassCast& c) {
+            ClassCastNode* node = new ClassCastNode{c, first()};
+            while (!head.compare_exchange_weak(node->next, node,
+                                               std::memory_order_release,
+                                               std::memory_order_acquire)) {}
+        }
+    };
+
+    struct ClassInfo {
+        ClassCastList bases;
+        ClassCastList derived;
+    };
+
+    /* a unique id for each c++ type bound through Class_, it tags the
+     * userdata holding the objects and keys the metatable in the registry */
+    template<typename T>
+    struct ClassId {
+        static const void* id() {
+            static const char tag = 0;
+            return &tag;
+        }
+        // the name of the first binding, shared by every state
+        static const std::string& name() {
+            static const std::string unbound("userdata");
+            const std::string* n = slot().load(std::memory_order_acquire);
+            return n ? *n : unbound;
+        }
+
+        // later bindings, in any state or thread, keep the first name
+        static void setName(const std::string& n) {
+            if (slot().load(std::memory_order_acquire)) { return; }
+            const std::string* named = new std::string(n);
+            const std::string* expected = nullptr;
+            if (!slot().compare_exchange_strong(expected, named,
+                                                std::memory_order_acq_rel)) {
+                delete named;
+            }
+        }
+        static ClassInfo& info() {
+            static ClassInfo i;
+            return i;
+        }
+    private:
+        static std::atomic<const std::string*>& slot() {
+            static std::atomic<const std::string*> n(nullptr);
+            return n;
+        }
+    };
+
+    template<typename Derived, typename Base>
+    void* upcast(void* p) {
+        return static_cast<Base*>(static_cast<Derived*>(p));
+    }
+
+    template<typename Derived, typename Base>
+    bool linkBaseClass() {
+        ClassInfo& info = ClassId<Derived>::info();
+        std::vector<ClassCast> found;
+        found.push_back(ClassCast{ClassId<Base>::id(), &ClassId<Base>::info(),
+                                  {&upcast<Derived, Base>}});
+        for (auto n = ClassId<Base>::info().bases.first(); n; n = n->next) {
+            const ClassCast& c = n->cast;
+            ClassCast far{c.cls, c.info, {&upcast<Derived, Base>}};
+            far.path.insert(far.path.end(), c.path.begin(), c.path.end());
+            found.push_back(far);
+        }
+        for (const ClassCast& c : found) {
+            info.bases.push(c);
+            c.info->derived.push(ClassCast{ClassId<Derived>::id(), &info,
+                                           c.path});
+        }
+        return true;
+    }
+
+    /* Base and all of its own bases become bases of Derived. Linked once
+     * per process, whichever state or thread binds the pair first */
+    template<typename Derived, typename Base>
+    void addBaseClass() {
+        static const bool linked = linkBaseClass<Derived, Base>();
+        (void)linked;
+    }
+
+    /* the object a method is called on, always read through the type tag
+     * even if T is convertible from another lua type */
+    template<typename T>
+    struct Self {
+        T* ptr;
+    };
+
+    /* how a bound object is held by its userdata. A Const object is only
+     * passed to const references, pointers and methods. */
+    enum class Holding : unsigned char {
+        Value, Borrowed, Shared, Unique, Const
+    };
+
+    /* placed at the end of every userdata created for a bound class, it
+     * locates the object whatever the payload holding it */
+    struct ClassTag {
+        const void* cls;
+        void* object;
+        // destroys the payload from __gc, null if nothing to destroy
+        void (*destroy)(void*);
+        Holding holding;
+    };
+
+    /* block layout: payload (the object, or a holder of it) aligned up to
+     * its own alignment, then the tag at the end of the block */
+    template<typename Payload>
+    struct ClassBox {
+        enum {
+            offset = AlignPad<Payload>::value
+                     + (sizeof(Payload) + alignof(ClassTag) - 1)
+                     / alignof(ClassTag) * alignof(ClassTag),
+            size = offset + sizeof(ClassTag)
+        };
+
+        static void* alloc(lua_State* st, ClassTag*& tag) {
+            char* buf = static_cast<char*>(lua_newuserdata(st, size));
+            tag = reinterpret_cast<ClassTag*>(buf + offset);
+            return alignUp(buf, alignof(Payload));
+        }
+    };
+
+    /* the tag of the bound object at index. It is trusted only if the
+     * userdata has the metatable registered for the class the tag names,
+     * so other userdata are never read as bound objects */
+    inline ClassTag* classTag(lua_State* st, int index) {
+        if (lua_type(st, index) != LUA_TUSERDATA) { return nullptr; }
+        std::size_t len = lua_rawlen(st, index);
+        if (len < sizeof(ClassTag)) { return nullptr; }
+        char* block = static_cast<char*>(lua_touserdata(st, index))
+                      + len - sizeof(ClassTag);
+        if (reinterpret_cast<std::uintptr_t>(block) % alignof(ClassTag)) {
+            return nullptr;
+        }
+        ClassTag* tag = reinterpret_cast<ClassTag*>(block);
+        if (!tag->cls || !lua_getmetatable(st, index)) { return nullptr; }
+        lua_rawgetp(st, LUA_REGISTRYINDEX, tag->cls);
+        bool bound = lua_rawequal(st, -1, -2);
+        lua_pop(st, 2);
+        return bound ? tag : nullptr;
+    }
+
+    // the bound object of type T at index, or of a class derived from T,
+    // nullptr if it holds another type
+    template<typename T>
+    T* toClass(lua_State* st, int index) {
+        ClassTag* tag = classTag(st, index);
+        if (!tag) { return nullptr; }
+        if (tag->cls == ClassId<T>::id()) {
+            return static_cast<T*>(tag->object);
+        }
+        for (auto n = ClassId<T>::info().derived.first(); n; n = n->next) {
+            if (n->cast.cls == tag->cls) {
+                return static_cast<T*>(n->cast.apply(tag->object));
+            }
+        }
+        return nullptr;
+    }
+
+    // push the metatable registered by Class_<T>
+    template<typename T>
+    void pushClassMetatable(lua_State* st) {
+        lua_rawgetp(st, LUA_REGISTRYINDEX, ClassId<T>::id());
+        if (!lua_istable(st, -1)) {
+            lua_pop(st, 1);
+            throw RuntimeError(ClassId<T>::name() + " is not a bound class");
+        }
+    }
+
+    // p is the block of the userdata
+    template<typename Payload>
+    void destroyPayload(void* p) {
+        static_cast<Payload*>(alignUp(p, alignof(Payload)))->~Payload();
+    }
+
+    /* the metatable of plain userdata holding a T, its __gc runs the
+     * destructor. Nothing is set for trivially destructible types. */
+    template<typename T, bool trivial = std::is_trivially_destructible<T>::value>
+    struct UserDataGC {
+        static int gc(lua_State* st) {
+            destroyPayload<T>(lua_touserdata(st, 1));
+            return 0;
+        }
+
+        static void attach(lua_State* st) {
+            static const char key = 0;
+            lua_rawgetp(st, LUA_REGISTRYINDEX, &key);
+            if (lua_isnil(st, -1)) {
+                lua_pop(st, 1);
+                lua_createtable(st, 0, 1);
+                lua_pushcfunction(st, &UserDataGC::gc);
+                lua_setfield(st, -2, "__gc");
+                lua_pushvalue(st, -1);
+                lua_rawsetp(st, LUA_REGISTRYINDEX, &key);
+            }
+            lua_setmetatable(st, -2);
+        }
+    };
+
+    template<typename T>
+    struct UserDataGC<T, true> {
+        static int gc(lua_State*) { return 0; }
+        static void attach(lua_State*) {}
+    };
+
+    /* push a userdata for class T holding the Payload construct(buf) builds
+     * in place. The metatable is looked up first, so a failure leaks
+     * nothing. */
+    template<typename T, typename Payload, typename Construct>
+    Payload* newClassBoxWith(lua_State* st, Holding holding, ClassTag*& tag,
+                             Construct construct) {
+        pushClassMetatable<T>(st);
+        void* buf = ClassBox<Payload>::alloc(st, tag);
+        Payload* payload = construct(buf);
+        tag->cls = ClassId<T>::id();
+        tag->object = nullptr;
+        tag->destroy = std::is_trivially_destructible<Payload>::value
+                       ? nullptr : &destroyPayload<Payload>;
+        tag->holding = holding;
+        lua_insert(st, -2);
+        lua_setmetatable(st, -2);
+        return payload;
+    }
+
+    template<typename T, typename Payload, typename... Args>
+    Payload* newClassBox(lua_State* st, Holding holding, ClassTag*& tag,
+                         Args&&... args) {
+        return newClassBoxWith<T, Payload>(st, holding, tag, [&](void* buf) {
+            return new (buf) Payload(std::forward<Args>(args)...);
+        });
+    }
+
+    // construct a T by value inside a new tagged userdata
+    template<typename T, typename... Args>
+    T* newClassObject(lua_State* st, Args&&... args) {
+        ClassTag* tag;
+        T* obj = newClassBox<T, T>(st, Holding::Value, tag,
+                                   std::forward<Args>(args)...);
+        tag->object = obj;
+        return obj;
+    }
+
+    // a T initialized from the prvalue make() returns, the copy is elided
+    template<typename T, typename F>
+    T* newClassResult(lua_State* st, F make) {
+        ClassTag* tag;
+        T* obj = newClassBoxWith<T, T>(st, Holding::Value, tag, [&](void* buf) {
+            return new (buf) T(make());
+        });
+        tag->object = obj;
+        return obj;
+    }
+
+    /* __gc of every bound class, the tag is cleared so that the object can
+     * neither be destroyed twice nor used after destruction */
+    inline int classGC(lua_State* st) {
+        ClassTag* tag = classTag(st, 1);
+        if (tag && tag->destroy) {
+            void (*destroy)(void*) = tag->destroy;
+            tag->destroy = nullptr;
+            tag->cls = nullptr;
+            destroy(lua_touserdata(st, 1));
+        }
+        return 0;
+    }
+}
+
+/* an object owned by c++, exposed to lua by pointer instead of a copy.
+ * the object must outlive every lua reference to it */
+template<typename T>
+struct Borrowed {
+    T* ptr;
+};
+
+template<typename T>
+Borrowed<T> borrow(T& obj) { return Borrowed<T>{&obj}; }
+
 struct VarBase {
     lua_State *state;
     VarBase(lua_State *st) : state(st) {}
@@ -317,6 +886,48 @@ struct VarProxy<UserData> : VarBase {
     enum { tid = LUA_TUSERDATA };
 };
 
+template<typename T>
+struct VarProxy<Borrowed<T>> : VarBase {
+    bool push(const Borrowed<T>& b) {
+        detail::ClassTag* tag;
+        detail::newClassBox<T, T*>(state, detail::Holding::Borrowed, tag, b.ptr);
+        tag->object = b.ptr;
+        return true;
+    }
+};
+
+/* shared ownership between c++ and lua, the object is released when the
+ * last owner on either side drops it */
+template<typename T>
+struct VarProxy<std::shared_ptr<T>> : VarBase {
+    bool push(const std::shared_ptr<T>& p) {
+        if (!p) { lua_pushnil(state); return true; }
+        detail::ClassTag* tag;
+        typedef typename std::remove_cv<T>::type Class;
+        // type erased, the deleter of p still destroys a T
+        detail::newClassBox<Class, std::shared_ptr<void>>(
+            state, detail::Holding::Shared, tag, p);
+        tag->object = const_cast<Class*>(p.get());
+        return true;
+    }
+};
+
+/* assigning a unique_ptr rvalue transfers the ownership to lua, the
+ * pointer is left empty */
+template<typename T, typename D>
+struct VarProxy<detail::UniqueTransfer<T, D>> : VarBase {
+    bool push(const detail::UniqueTransfer<T, D>& t) {
+        std::unique_ptr<T, D>& p = *t.ptr;
+        if (!p) { lua_pushnil(state); return true; }
+        detail::ClassTag* tag;
+        T* obj = p.get();
+        detail::newClassBox<T, std::unique_ptr<T, D>>(
+            state, detail::Holding::Unique, tag, std::move(p));
+        tag->object = obj;
+        return true;
+    }
+};
+
 template<>
 struct VarProxy<CFunction> : VarBase {
     CFunction get(int index, bool& success) {
@@ -335,6 +946,24 @@ struct VarProxy<std::string> : VarBase {
     }
 };
 
+/* a string interned once per state by State::key(), pushed with a single
+ * registry lookup instead of hashing the characters again. A key belongs
+ * to the state which created it (and the coroutines of that state) */
+class Key {
+    int ref;
+public:
+    explicit Key(int ref) : ref(ref) {}
+    int id() const { return ref; }
+};
+
+template<>
+struct VarProxy<Key> : VarBase {
+    bool push(const Key& k) {
+        lua_rawgeti(state, LUA_REGISTRYINDEX, k.id());
+        return true;
+    }
+};
+
 template<>
 struct VarProxy<const char*> : VarBase {
     const char *get(int index, bool& success) {
@@ -365,16 +994,17 @@ struct VarProxy<Number> : VarBase  {
 namespace detail {
     /* all in/out lua variable types that expected to be converted to/from
      * automatically (as a function arguments or return value)
-     * should be placed in this mpl vector.
+     * should be placed in this type list, ordered by priority: the first
+     * proxy that matches is selected.
      */
-    typedef boost::mpl::vector<
-                std::string,
-                const char*,
-                Number,
-                CClosure,
-                Table,
+    typedef TypeList<
+                Nil,
                 UserData,
-                Nil
+                Table,
+                CClosure,
+                Number,
+                const char*,
+                std::string
             > varproxies;
     struct PlaceHolder {};
 
@@ -394,7 +1024,8 @@ namespace detail {
         template<typename P, typename V>
         static two test(...);
 
-        typedef boost::mpl::bool_<sizeof(test<Proxy, Var>(true)) == 1> type;
+        enum { value = sizeof(test<Proxy, Var>(true)) == 1 };
+        typedef std::integral_constant<bool, value> type;
     };
 
     template<typename Proxy, typename Var>
@@ -423,20 +1054,31 @@ namespace detail {
         template<typename P, typename V>
         static two test(...);
 
-        typedef boost::mpl::bool_<sizeof(test<Proxy, Var>(nullptr)) == 1> type;
+        enum { value = sizeof(test<Proxy, Var>(nullptr)) == 1 };
+        typedef std::integral_constant<bool, value> type;
     };
 
+    template<typename T>
+    struct Identity { typedef T type; };
+
+    /* pick the first proxy in List satisfying Pred, the remaining
+     * candidates are not instantiated once a match is found */
+    template<template<class, class> class Pred, typename T,
+             typename List = varproxies>
+    struct SelectImpl;
+
     template<template<class, class> class Pred, typename T>
-    struct SelectImpl
-    {
-        typedef typename boost::mpl::fold<
-            detail::varproxies,
-            detail::PlaceHolder,
-            // _1 is state, _2 is current item
-            boost::mpl::if_<Pred<boost::mpl::_2, T>,
-                            boost::mpl::_2, // select current item
-                            boost::mpl::_1> // keep last item
-        >::type type;
+    struct SelectImpl<Pred, T, TypeList<>> {
+        typedef PlaceHolder type;
+    };
+
+    template<template<class, class> class Pred, typename T,
+             typename P, typename... Ps>
+    struct SelectImpl<Pred, T, TypeList<P, Ps...>> {
+        typedef typename std::conditional<Pred<P, T>::value,
+            Identity<P>,
+            SelectImpl<Pred, T, TypeList<Ps...>>
+        >::type::type type;
     };
 
     template<typename Exception>
@@ -483,6 +1125,20 @@ namespace detail {
     struct GenTuple<0, Arg, Args...> {
         typedef std::tuple<Args...> type;
     };
+
+    /* compile time integer sequence 0, 1, ..., N-1 */
+    template<int... I>
+    struct Seq {};
+
+    template<int N, int... I>
+    struct GenSeq {
+        typedef typename GenSeq<N-1, N-1, I...>::type type;
+    };
+
+    template<int... I>
+    struct GenSeq<0, I...> {
+        typedef Seq<I...> type;
+    };
 }
 
 
@@ -563,6 +1219,10 @@ struct Closure : public detail::HasMetaTable<Closure> {
 
     template<typename... Args>
     ReturnProxy call(Args&&... args) {
+        // room for the function and its arguments, checked once
+        if (!lua_checkstack(state, sizeof...(Args) + 1)) {
+            throw RuntimeError("stack overflow");
+        }
         // push the function to be called
         lua_pushnil(state);
         lua_copy(state, index, -1);
@@ -583,17 +1243,40 @@ struct Closure : public detail::HasMetaTable<Closure> {
     ReturnProxy __call__() {
         return ReturnProxy(this, count);
     }
+
+    /* calls the function once per element of [first, last), an element
+     * being one argument or a std::tuple of arguments, and writes the
+     * single results converted to R into out. The function, the stack
+     * space and the error handler are set up once for the whole batch.
+     * The first failing call throws RuntimeError naming the element, or
+     * BudgetExceeded if a Budget stopped it */
+    template<typename R, typename InputIt, typename OutputIt>
+    OutputIt map(InputIt first, InputIt last, OutputIt out);
+
+    // the same over columns: call i takes (cols[i]...), for i < n
+    template<typename R, typename OutputIt, typename... Cols>
+    OutputIt mapColumns(std::size_t n, OutputIt out, const Cols*... cols);
 private:
+    template<typename R, typename OutputIt, typename PushItem>
+    OutputIt batch(std::size_t n, int nargs, OutputIt out, PushItem push);
+
     Closure(const Closure&);
 };
 
 
 inline ReturnProxy& ReturnProxy::call(int nresults) {
-    auto i = lua_pcall(self->state, nargs, nresults, 0);
+    // detach first, so that the destructor never re-runs a failed call
+    lua_State* st = self->state;
+    self = nullptr;
+    auto i = lua_pcall(st, nargs, nresults, 0);
     if (i != LUA_OK) {
-        throw RuntimeError(lua_tostring(self->state, -1));
+        std::string msg = lua_tostring(st, -1);
+        lua_pop(st, 1);
+        if (const Budget* budget = Budget::current(st)) {
+            throw budget->error();
+        }
+        throw RuntimeError(msg);
     }
-    self = nullptr;
     return *this;
 }
 
@@ -613,22 +1296,23 @@ inline typename Closure::Rvals<1>::type Closure::__return__<1>() {
     return Closure::Rvals<1>::type(state, lua_gettop(state));
 }
 
+namespace detail {
+    /* the top n stack slots as a tuple of variants, bottom first */
+    template<int n, typename S = typename GenSeq<n>::type>
+    struct ReturnMaker;
+
+    template<int n, int... I>
+    struct ReturnMaker<n, Seq<I...>> {
+        static typename GenTuple<n>::type make(lua_State* st) {
+            return typename GenTuple<n>::type(Variant<>(st, I - n)...);
+        }
+    };
+}
 
-#ifndef LUAMM_MAX_RETVALUES
-#define LUAMM_MAX_RETVALUES 15
-#endif
-#define LUAMM_X(n) Variant<>(state, -n)BOOST_PP_COMMA_IF(BOOST_PP_SUB(n,1))
-#define LUAMM_Y(a, b, c) LUAMM_X(BOOST_PP_SUB(c, b))
-#define LUAMM_ARGS(n) BOOST_PP_REPEAT(n, LUAMM_Y, n)
-#define LUAMM_RET(_a, n, _b) template<>\
-    inline typename Closure::Rvals<n>::type Closure::__return__<n>() {\
-        return std::make_tuple(LUAMM_ARGS(n)); \
-    }
-BOOST_PP_REPEAT_FROM_TO(2, LUAMM_MAX_RETVALUES, LUAMM_RET,)
-#undef LUAMM_X
-#undef LUAMM_Y
-#undef LUAMM_ARGS
-#undef LUAMM_RET
+template<int rvals>
+typename Closure::Rvals<rvals>::type Closure::__return__() {
+    return detail::ReturnMaker<rvals>::make(state);
+}
 
 template<typename... Args>
 void TieProxy<Args...>::operator=(ReturnProxy&& retproxy) {
@@ -647,6 +1331,104 @@ ReturnProxy::operator std::tuple<Args...>() &&
     return tup;
 }
 
+namespace detail {
+    // the arguments of one call in a batch
+    template<typename T>
+    struct BatchArgs {
+        enum { size = 1 };
+        static bool push(lua_State* st, const T& v) {
+            return VarPusher<T>::push(st, v);
+        }
+    };
+
+    template<typename... Args>
+    struct BatchArgs<std::tuple<Args...>> {
+        enum { size = sizeof...(Args) };
+
+        template<int... I>
+        static bool push(lua_State* st, const std::tuple<Args...>& t, Seq<I...>) {
+            bool ok = true;
+            int _[] = { 0, (ok = ok && VarPusher<Args>::push(st, std::get<I>(t)), 0)... };
+            (void)_; (void)st;
+            return ok;
+        }
+
+        static bool push(lua_State* st, const std::tuple<Args...>& t) {
+            return push(st, t, typename GenSeq<sizeof...(Args)>::type());
+        }
+    };
+
+    // message handler of batched calls, adds a traceback
+    inline int batchHandler(lua_State* st) {
+        const char* msg = lua_tostring(st, 1);
+        luaL_traceback(st, st, msg ? msg : "(error object is not a string)", 1);
+        return 1;
+    }
+}
+
+template<typename R, typename OutputIt, typename PushItem>
+OutputIt Closure::batch(std::size_t n, int nargs, OutputIt out, PushItem push)
+{
+    lua_State* st = state;
+    int base = lua_gettop(st);
+    if (!lua_checkstack(st, nargs + 3)) {
+        throw RuntimeError("stack overflow");
+    }
+    lua_pushcfunction(st, detail::batchHandler);
+    int handler = base + 1;
+    for (std::size_t i = 0; i < n; i++) {
+        lua_pushvalue(st, index);
+        if (!push(st, i)) {
+            lua_settop(st, base);
+            throw VarPushError();
+        }
+        if (lua_pcall(st, nargs, 1, handler) != LUA_OK) {
+            const char* m = lua_tostring(st, -1);
+            std::string msg = m ? m : "unknown error";
+            lua_settop(st, base);
+            std::string item = "batch item " + std::to_string(i) + ": ";
+            if (const Budget* budget = Budget::current(st)) {
+                BudgetExceeded e = budget->error();
+                throw BudgetExceeded(e.reason, item + e.what());
+            }
+            throw RuntimeError(item + msg);
+        }
+        bool ok = false;
+        R r = VarGetter<R>::get(st, -1, ok);
+        lua_pop(st, 1);
+        if (!ok) {
+            lua_settop(st, base);
+            throw RuntimeError("batch item " + std::to_string(i) +
+                               ": unexpected result type");
+        }
+        *out++ = std::move(r);
+    }
+    lua_settop(st, base);
+    return out;
+}
+
+template<typename R, typename InputIt, typename OutputIt>
+OutputIt Closure::map(InputIt first, InputIt last, OutputIt out)
+{
+    typedef detail::BatchArgs<
+        typename std::iterator_traits<InputIt>::value_type> Args;
+    std::size_t n = static_cast<std::size_t>(std::distance(first, last));
+    return batch<R>(n, Args::size, out, [&first](lua_State* st, std::size_t) {
+        return Args::push(st, *first++);
+    });
+}
+
+template<typename R, typename OutputIt, typename... Cols>
+OutputIt Closure::mapColumns(std::size_t n, OutputIt out, const Cols*... cols)
+{
+    return batch<R>(n, sizeof...(Cols), out, [=](lua_State* st, std::size_t i) {
+        bool ok = true;
+        int _[] = { 0, (ok = ok && VarPusher<Cols>::push(st, cols[i]), 0)... };
+        (void)_; (void)st;
+        return ok;
+    });
+}
+
 namespace detail {
     template<>
     struct StackVariable<Closure> {
@@ -684,6 +1466,15 @@ struct KeyGetError : RuntimeError { KeyGetError() : RuntimeError("") {} };
 struct KeyPutError : RuntimeError { KeyPutError() : RuntimeError("") {} };
 struct VarGetError : RuntimeError { VarGetError() : RuntimeError("") {} };
 
+/* bad argument passed to a bound callable */
+struct ArgError : RuntimeError {
+    ArgError(lua_State* st, int narg, int expected, int got)
+        : ArgError(narg, lua_typename(st, expected), lua_typename(st, got)) {}
+    ArgError(int narg, const std::string& expected, const std::string& got)
+        : RuntimeError(std::string("bad argument#") + std::to_string(narg)
+                       + " (" + expected + " expected, got " + got + ")") {}
+};
+
 
 template<>
 struct VarProxy<Table> : VarBase {
@@ -854,19 +1645,58 @@ struct KeySetter<lua_State*, std::string, Var> {
 };
 
 
-template<typename Key>
-struct KeyTyper<Table*, Key> {
-    static int type(Table *t, const Key& k) {
-        {
-            detail::Guard<VarPushError> gd;
-            gd.status = VarPusher<Key>::push(t->state, k);
-        }
-        lua_gettable(t->state, t->index);
-        detail::AutoPopper ap(t->state);
-        return lua_type(t->state, -1);
-    }
-};
-
+// global variable, interned key
+template<typename Var>
+struct KeyGetter<lua_State*, Key, Var> {
+    static Var get(lua_State* container, const Key& key) {
+        lua_rawgeti(container, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        lua_rawgeti(container, LUA_REGISTRYINDEX, key.id());
+        lua_gettable(container, -2);
+        lua_remove(container, -2);
+        detail::Guard<VarGetError> gd;
+        detail::AutoPopper ap(container, 1 - detail::StackVariable<Var>::value);
+        return VarGetter<Var>::get(container, -1, gd.status);
+    }
+};
+
+template<>
+struct KeyTyper<lua_State*, Key> {
+    static int type(lua_State* st, const Key& k) {
+        lua_rawgeti(st, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        lua_rawgeti(st, LUA_REGISTRYINDEX, k.id());
+        lua_gettable(st, -2);
+        detail::AutoPopper ap(st, 2);
+        return lua_type(st, -1);
+    }
+};
+
+template<typename Var>
+struct KeySetter<lua_State*, Key, Var> {
+    static void set(lua_State* container, const Key& key, const Var& nv) {
+        lua_rawgeti(container, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        lua_rawgeti(container, LUA_REGISTRYINDEX, key.id());
+        {
+            detail::Guard<VarPushError> gd;
+            gd.status = VarPusher<Var>::push(container, nv);
+        }
+        lua_settable(container, -3);
+        lua_pop(container, 1);
+    }
+};
+
+template<typename Key>
+struct KeyTyper<Table*, Key> {
+    static int type(Table *t, const Key& k) {
+        {
+            detail::Guard<VarPushError> gd;
+            gd.status = VarPusher<Key>::push(t->state, k);
+        }
+        lua_gettable(t->state, t->index);
+        detail::AutoPopper ap(t->state);
+        return lua_type(t->state, -1);
+    }
+};
+
 template<typename Key, typename Var>
 struct KeyGetter<Table*, Key, Var> {
     static Var get(Table* container, const Key& key) {
@@ -905,7 +1735,417 @@ struct KeySetter<Table*, Key, Var> {
 };
 
 
+#ifdef LUAMM_CALL_STATS
+/* per binding call statistics, compiled in with -DLUAMM_CALL_STATS.
+ * Every callable created by State::newCallable (thus also class methods and
+ * attribute accessors) counts its calls, errors, the time spent converting
+ * arguments and the time spent in the body. Counters are kept per thread
+ * and written without locks, snapshot() merges them. */
+namespace callstats {
+    typedef std::chrono::steady_clock clock;
+
+    /* log-linear latency histogram in nanoseconds: 4 sub buckets per power
+     * of two, so a reported quantile is within 25% of the real value */
+    struct Histogram {
+        enum { buckets = 252 };
+        std::atomic<std::uint64_t> counts[buckets];
+
+        static int bucket(std::uint64_t v) {
+            if (v < 4) return static_cast<int>(v);
+            int e = 63;
+#if defined(__GNUC__)
+            e -= __builtin_clzll(v);
+#else
+            while (!(v >> e)) { e--; }
+#endif
+            return 4 * (e - 1) + static_cast<int>((v >> (e - 2)) & 3);
+        }
+
+        // largest value falling into bucket i
+        static std::uint64_t upper(int i) {
+            if (i + 1 >= buckets) return UINT64_MAX;
+            int j = i + 1;
+            if (j < 4) return static_cast<std::uint64_t>(j) - 1;
+            return (static_cast<std::uint64_t>(4 + j % 4) << (j / 4 - 1)) - 1;
+        }
+    };
+
+    // written by one thread only, read by anyone
+    struct Counters {
+        std::atomic<std::uint64_t> calls, errors, convert_ns, body_ns, max_ns;
+        Histogram latency;
+
+        Counters() { clear(); }
+
+        void clear() {
+            calls = errors = convert_ns = body_ns = max_ns = 0;
+            for (auto& c : latency.counts) { c = 0; }
+        }
+
+        static void add(std::atomic<std::uint64_t>& c, std::uint64_t v) {
+            c.store(c.load(std::memory_order_relaxed) + v,
+                    std::memory_order_relaxed);
+        }
+
+        void record(std::uint64_t convert, std::uint64_t body, bool failed) {
+            std::uint64_t total = convert + body;
+            add(calls, 1);
+            if (failed) add(errors, 1);
+            add(convert_ns, convert);
+            add(body_ns, body);
+            add(latency.counts[Histogram::bucket(total)], 1);
+            if (total > max_ns.load(std::memory_order_relaxed)) {
+                max_ns.store(total, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    struct Summary {
+        std::string name;
+        std::uint64_t calls, errors;
+        std::uint64_t convert_ns, body_ns;  // accumulated
+        std::uint64_t p50_ns, p90_ns, p99_ns, max_ns;
+    };
+
+    /* binding names and the counters of every thread which called them.
+     * The mutex is only taken when a binding is created, on the first call
+     * of a binding from a thread, and by snapshots. */
+    class Registry {
+        struct Binding {
+            std::string name;
+            std::vector<std::unique_ptr<Counters>> threads;
+        };
+        std::mutex mutex;
+        std::vector<Binding> bindings;
+        std::unordered_map<std::string, int> ids;
+
+        static std::vector<Counters*>& local() {
+            thread_local std::vector<Counters*> counters;
+            return counters;
+        }
+
+        static std::uint64_t quantile(const std::uint64_t* counts,
+                                      std::uint64_t total, double q) {
+            std::uint64_t rank = static_cast<std::uint64_t>(q * total), seen = 0;
+            for (int i = 0; i < Histogram::buckets; i++) {
+                seen += counts[i];
+                if (seen > rank) return Histogram::upper(i);
+            }
+            return 0;
+        }
+    public:
+        static Registry& instance() {
+            static Registry registry;
+            return registry;
+        }
+
+        // bindings sharing a name share their counters
+        int id(const std::string& name) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = ids.find(name);
+            if (it != ids.end()) return it->second;
+            int id = static_cast<int>(bindings.size());
+            bindings.push_back(Binding{name, {}});
+            ids[name] = id;
+            return id;
+        }
+
+        Counters& counters(int id) {
+            auto& cache = local();
+            if (static_cast<std::size_t>(id) >= cache.size()) {
+                cache.resize(id + 1, nullptr);
+            }
+            if (!cache[id]) {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto& threads = bindings[id].threads;
+                threads.emplace_back(new Counters());
+                cache[id] = threads.back().get();
+            }
+            return *cache[id];
+        }
+
+        std::vector<Summary> snapshot() {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<Summary> r;
+            for (auto& b : bindings) {
+                Summary s{b.name, 0, 0, 0, 0, 0, 0, 0, 0};
+                std::uint64_t counts[Histogram::buckets] = {};
+                for (auto& c : b.threads) {
+                    s.calls += c->calls;
+                    s.errors += c->errors;
+                    s.convert_ns += c->convert_ns;
+                    s.body_ns += c->body_ns;
+                    if (c->max_ns > s.max_ns) s.max_ns = c->max_ns;
+                    for (int i = 0; i < Histogram::buckets; i++) {
+                        counts[i] += c->latency.counts[i];
+                    }
+                }
+                if (s.calls == 0) continue;
+                s.p50_ns = std::min(quantile(counts, s.calls, 0.5), s.max_ns);
+                s.p90_ns = std::min(quantile(counts, s.calls, 0.9), s.max_ns);
+                s.p99_ns = std::min(quantile(counts, s.calls, 0.99), s.max_ns);
+                r.push_back(s);
+            }
+            return r;
+        }
+
+        // counts updated concurrently with a reset may survive it
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& b : bindings) {
+                for (auto& c : b.threads) { c->clear(); }
+            }
+        }
+    };
+
+    // end of argument conversion of the innermost running binding
+    inline clock::time_point& converted() {
+        thread_local clock::time_point mark;
+        return mark;
+    }
+
+    /* timing of one call, bindings calling back into lua may nest */
+    class Timer {
+        int id;
+        clock::time_point start, outer;
+    public:
+        Timer(int id) : id(id), start(clock::now()), outer(converted()) {
+            converted() = clock::time_point();
+        }
+
+        void finish(bool failed) {
+            auto end = clock::now();
+            auto mark = converted();
+            // failed before the body was entered
+            if (mark == clock::time_point()) { mark = end; }
+            typedef std::chrono::nanoseconds ns;
+            Registry::instance().counters(id).record(
+                std::chrono::duration_cast<ns>(mark - start).count(),
+                std::chrono::duration_cast<ns>(end - mark).count(),
+                failed);
+            converted() = outer;
+        }
+    };
+
+    inline std::vector<Summary> snapshot() {
+        return Registry::instance().snapshot();
+    }
+
+    inline void reset() { Registry::instance().reset(); }
+
+    /* lua_CFunction returning {name = {calls=, errors=, convert_ns=,
+     * body_ns=, p50_ns=, p90_ns=, p99_ns=, max_ns=}, ...} */
+    inline int luaSnapshot(lua_State* st) {
+        auto stats = snapshot();
+        lua_createtable(st, 0, static_cast<int>(stats.size()));
+        for (auto& s : stats) {
+            lua_createtable(st, 0, 8);
+            const std::pair<const char*, std::uint64_t> fields[] = {
+                {"calls", s.calls}, {"errors", s.errors},
+                {"convert_ns", s.convert_ns}, {"body_ns", s.body_ns},
+                {"p50_ns", s.p50_ns}, {"p90_ns", s.p90_ns},
+                {"p99_ns", s.p99_ns}, {"max_ns", s.max_ns}
+            };
+            for (auto& f : fields) {
+                lua_pushnumber(st, static_cast<lua_Number>(f.second));
+                lua_setfield(st, -2, f.first);
+            }
+            lua_setfield(st, -2, s.name.c_str());
+        }
+        return 1;
+    }
+}
+#endif
+
+namespace detail {
+    // results of the class itself are built in place in a new userdata
+    template<typename T, typename R,
+             bool inplace = std::is_same<typename std::decay<R>::type, T>::value>
+    struct OpResult {
+        template<typename F>
+        static void push(lua_State* st, F make) {
+            VarPusher<typename std::decay<R>::type>::push(st, make());
+        }
+    };
+
+    template<typename T, typename R>
+    struct OpResult<T, R, true> {
+        template<typename F>
+        static void push(lua_State* st, F make) { newClassResult<T>(st, make); }
+    };
+
+    /* a metamethod of class T from a binary c++ operator. An operand is
+     * either a T or a number, the combinations T lacks an operator for are
+     * rejected at run time. */
+    template<typename Op, typename T>
+    struct BinaryMeta {
+        template<typename A, typename B>
+        static auto apply(lua_State* st, const A& a, const B& b, int)
+            -> decltype(Op::apply(a, b), bool()) {
+            typedef decltype(Op::apply(a, b)) R;
+            OpResult<T, R>::push(st, [&]() { return Op::apply(a, b); });
+            return true;
+        }
+
+        template<typename A, typename B>
+        static bool apply(lua_State*, const A&, const B&, long) {
+            return false;
+        }
+
+        static bool dispatch(lua_State* st) {
+            T* a = toClass<T>(st, 1);
+            T* b = toClass<T>(st, 2);
+            if (a && b) {
+                return apply(st, *a, *b, 0);
+            } else if (a && lua_type(st, 2) == LUA_TNUMBER) {
+                return apply(st, *a, lua_tonumber(st, 2), 0);
+            } else if (b && lua_type(st, 1) == LUA_TNUMBER) {
+                return apply(st, lua_tonumber(st, 1), *b, 0);
+            }
+            return false;
+        }
+
+        static int meta(lua_State* st) {
+            bool failed = false, done = false;
+            try {
+                done = dispatch(st);
+            } catch (std::exception& e) {
+                lua_pushstring(st, e.what());
+                failed = true;
+            }
+            if (failed) { return lua_error(st); }
+            if (!done) {
+                return luaL_error(st, "bad operands for %s (%s and %s)",
+                                  Op::name(), luaL_typename(st, 1),
+                                  luaL_typename(st, 2));
+            }
+            return 1;
+        }
+    };
+
+    template<typename T>
+    void appendOperand(lua_State* st, int index, std::string& out) {
+        if (T* obj = toClass<T>(st, index)) {
+            std::ostringstream os;
+            os << *obj;
+            out += os.str();
+        } else {
+            std::size_t len = 0;
+            const char* s = luaL_checklstring(st, index, &len);
+            out.append(s, len);
+        }
+    }
+
+    template<typename T>
+    struct StreamMeta {
+        static int tostring(lua_State* st) {
+            bool failed = false;
+            try {
+                std::string out;
+                appendOperand<T>(st, 1, out);
+                lua_pushlstring(st, out.data(), out.size());
+            } catch (std::exception& e) {
+                lua_pushstring(st, e.what());
+                failed = true;
+            }
+            return failed ? lua_error(st) : 1;
+        }
+
+        // one string operand is converted by lua before the call
+        static int concat(lua_State* st) {
+            if (!toClass<T>(st, 1)) { luaL_checkstring(st, 1); }
+            if (!toClass<T>(st, 2)) { luaL_checkstring(st, 2); }
+            bool failed = false;
+            try {
+                std::string out;
+                appendOperand<T>(st, 1, out);
+                appendOperand<T>(st, 2, out);
+                lua_pushlstring(st, out.data(), out.size());
+            } catch (std::exception& e) {
+                lua_pushstring(st, e.what());
+                failed = true;
+            }
+            return failed ? lua_error(st) : 1;
+        }
+    };
+
+    template<typename T>
+    int lenMeta(lua_State* st) {
+        T* obj = toClass<T>(st, 1);
+        if (!obj) {
+            return luaL_argerror(st, 1, ClassId<T>::name().c_str());
+        }
+        lua_pushnumber(st, static_cast<lua_Number>(obj->size()));
+        return 1;
+    }
+}
+
+/* metamethods of a bound class made from its c++ operators, passed to
+ * Class_::operators. The arithmetic ones accept a number on either side
+ * when the class has the matching operator. */
+namespace op {
+#define LUAMM_BINARY_OP(tag, metaname, expr)                               \
+    struct tag {                                                           \
+        static const char* name() { return metaname; }                    \
+        template<typename A, typename B>                                   \
+        static auto apply(const A& a, const B& b) -> decltype(expr) {      \
+            return expr;                                                   \
+        }                                                                  \
+        template<typename T>                                               \
+        static CFunction function() {                                      \
+            return &detail::BinaryMeta<tag, T>::meta;                      \
+        }                                                                  \
+    };
+
+    LUAMM_BINARY_OP(add, "__add", a + b)
+    LUAMM_BINARY_OP(sub, "__sub", a - b)
+    LUAMM_BINARY_OP(mul, "__mul", a * b)
+    LUAMM_BINARY_OP(div, "__div", a / b)
+    LUAMM_BINARY_OP(eq, "__eq", a == b)
+    LUAMM_BINARY_OP(lt, "__lt", a < b)
+    LUAMM_BINARY_OP(le, "__le", a <= b)
+#undef LUAMM_BINARY_OP
+
+    // lua passes the operand twice
+    struct unm {
+        static const char* name() { return "__unm"; }
+        template<typename A, typename B>
+        static auto apply(const A& a, const B&) -> decltype(-a) {
+            return -a;
+        }
+        template<typename T>
+        static CFunction function() {
+            return &detail::BinaryMeta<unm, T>::meta;
+        }
+    };
+
+    // the size() of the object
+    struct len {
+        static const char* name() { return "__len"; }
+        template<typename T>
+        static CFunction function() { return &detail::lenMeta<T>; }
+    };
+
+    // written with operator<<(std::ostream&, const T&)
+    struct tostring {
+        static const char* name() { return "__tostring"; }
+        template<typename T>
+        static CFunction function() { return &detail::StreamMeta<T>::tostring; }
+    };
+
+    struct concat {
+        static const char* name() { return "__concat"; }
+        template<typename T>
+        static CFunction function() { return &detail::StreamMeta<T>::concat; }
+    };
+
+    // binds T::operator() like a method, it must not be overloaded
+    struct call {};
+}
+
 class State;
+namespace detail { class OverloadSet; }
+
 template<typename Class>
 class Class_ {
     friend State;
@@ -917,6 +2157,24 @@ class Class_ {
     std::uintptr_t uuid;
     bool hasReadAttribute{false};
     bool hasWriteAttribute{false};
+    std::map<std::string, std::shared_ptr<detail::OverloadSet>> overloads;
+    template<typename F>
+    void bind(const std::string& method, F callable);
+
+    template<typename... Bases>
+    Class_(const std::string& name, State& state, detail::TypeList<Bases...>)
+        : Class_(name, state) {
+        int _[] = { 0, (inherit<Bases>(), 0)... };
+        (void)_;
+    }
+    template<typename Base>
+    void inherit();
+
+    template<typename Op>
+    void addOperator(Op) {
+        mtab[Op::name()] = CClosure(Op::template function<Class>());
+    }
+    void addOperator(op::call) { def("__call", &Class::operator()); }
 public:
     enum Attributes  {
         Read = 1,
@@ -936,6 +2194,14 @@ public:
     template<typename... Args>
     Class_<Class>& init();
 
+    // metamethods from the c++ operators, tags of namespace op
+    template<typename... Ops>
+    Class_<Class>& operators() {
+        int _[] = { 0, (addOperator(Ops()), 0)... };
+        (void)_;
+        return *this;
+    }
+
     template<typename T>
     Class_<Class>& attribute(const std::string& name, T Class::*mp,
                              unsigned perm = Read | Write);
@@ -946,7 +2212,150 @@ public:
     Table getmetatable();
 };
 
+/* control of the garbage collector of a state */
+class GC {
+    lua_State* state;
+public:
+    GC(lua_State* st) : state(st) {}
+
+    void stop() { lua_gc(state, LUA_GCSTOP, 0); }
+    void restart() { lua_gc(state, LUA_GCRESTART, 0); }
+    void collect() { lua_gc(state, LUA_GCCOLLECT, 0); }
+
+    // perform a step of about kbytes of work, true if a cycle finished
+    bool step(int kbytes = 0) { return lua_gc(state, LUA_GCSTEP, kbytes) != 0; }
+
+    // both return the previous value
+    int setpause(int percent) { return lua_gc(state, LUA_GCSETPAUSE, percent); }
+    int setstepmul(int percent) {
+        return lua_gc(state, LUA_GCSETSTEPMUL, percent);
+    }
+
+    // bytes in use
+    std::size_t count() {
+        return static_cast<std::size_t>(lua_gc(state, LUA_GCCOUNT, 0)) * 1024
+               + lua_gc(state, LUA_GCCOUNTB, 0);
+    }
+
+#ifdef LUA_GCISRUNNING
+    bool running() { return lua_gc(state, LUA_GCISRUNNING, 0) != 0; }
+#endif
+
+    // switch collector mode, false if lua has no generational mode
+    bool generational() {
+#ifdef LUA_GCGEN
+        lua_gc(state, LUA_GCGEN, 0);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool incremental() {
+#ifdef LUA_GCINC
+        lua_gc(state, LUA_GCINC, 0);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /* no automatic collection during the lifetime of a Pause, e.g. in a
+     * latency critical section. The collector is restarted afterwards
+     * only if it was running, so pauses nest */
+    class Pause {
+        lua_State* state;
+        bool wasRunning;
+    public:
+        Pause(lua_State* st)
+            : state(st), wasRunning(lua_gc(st, LUA_GCISRUNNING, 0) != 0) {
+            lua_gc(state, LUA_GCSTOP, 0);
+        }
+        Pause(Pause&& o) : state(o.state), wasRunning(o.wasRunning) {
+            o.state = nullptr;
+        }
+        Pause(const Pause&) = delete;
+        ~Pause() {
+            if (state && wasRunning) lua_gc(state, LUA_GCRESTART, 0);
+        }
+    };
+
+    Pause pause() { return Pause(state); }
+};
+
+/* spend a bounded amount of time stepping the collector, to be called when
+ * the state is idle (e.g. between requests) so that the collection work is
+ * moved out of the calls. Works with a stopped collector as well. */
+class GCScheduler {
+    lua_State* state;
+    std::chrono::microseconds budget;
+    int stepkb;
+public:
+    GCScheduler(lua_State* st, std::chrono::microseconds budget, int stepkb = 0)
+        : state(st), budget(budget), stepkb(stepkb) {}
+
+    // true if a collection cycle was completed within the budget
+    bool idle() {
+        typedef std::chrono::steady_clock clock;
+        auto deadline = clock::now() + budget;
+        do {
+            if (lua_gc(state, LUA_GCSTEP, stepkb)) { return true; }
+        } while (clock::now() < deadline);
+        return false;
+    }
+};
+
+/* the uniform representation of every c++ callable bound into lua */
+typedef std::function<int(lua_State*)> lua_Lambda;
+
 /* wrap an existing lua_State */
+namespace detail {
+    /* __index of the global table once State::lazy is used. A pending
+     * module is loaded by its first access, or taken from package.loaded
+     * if it was required already, and stays a plain global. Other keys go
+     * to the __index the global table had before. */
+    inline int lazyGlobal(lua_State* st) {
+        lua_pushvalue(st, 2);
+        lua_rawget(st, lua_upvalueindex(1));
+        if (lua_isnil(st, -1)) {
+            lua_pop(st, 1);
+            switch (lua_type(st, lua_upvalueindex(2))) {
+            case LUA_TFUNCTION:
+                lua_pushvalue(st, lua_upvalueindex(2));
+                lua_pushvalue(st, 1);
+                lua_pushvalue(st, 2);
+                lua_call(st, 2, 1);
+                return 1;
+            case LUA_TTABLE:
+                lua_pushvalue(st, 2);
+                lua_gettable(st, lua_upvalueindex(2));
+                return 1;
+            default:
+                lua_pushnil(st);
+                return 1;
+            }
+        }
+        CFunction loader = lua_tocfunction(st, -1);
+        const char* name = lua_tostring(st, 2);
+        lua_pop(st, 1);
+        luaL_getsubtable(st, LUA_REGISTRYINDEX, "_LOADED");
+        lua_getfield(st, -1, name);
+        if (lua_isnil(st, -1)) {
+            lua_pop(st, 2);
+            luaL_requiref(st, name, loader, 0);
+        } else {
+            lua_remove(st, -2);
+        }
+        lua_pushvalue(st, 2);
+        lua_pushvalue(st, -2);
+        lua_rawset(st, 1);
+        lua_pushvalue(st, 2);
+        lua_pushnil(st);
+        lua_rawset(st, lua_upvalueindex(1));
+        return 1;
+    }
+}
+
 class State {
 protected:
     lua_State *ptr_;
@@ -977,18 +2386,70 @@ public:
         return Variant<>(ptr(),-1);
     }
 
+    // make sure n more values fit on the stack
+    void reserve(int n) {
+        if (!lua_checkstack(ptr(), n)) {
+            throw RuntimeError("stack overflow");
+        }
+    }
+
+    // pushes every argument after a single reserve, returns their number
+    template<typename... Args>
+    int pushAll(const Args&... args) {
+        reserve(sizeof...(Args));
+        int base = top();
+        bool ok = true;
+        int _[] = { 0, (ok = ok && VarPusher<Args>::push(ptr(), args), 0)... };
+        (void)_;
+        if (!ok) {
+            settop(base);
+            throw VarPushError();
+        }
+        return sizeof...(Args);
+    }
+
+    // pushes the elements of [first, last), returns their number
+    template<typename InputIt>
+    int pushRange(InputIt first, InputIt last) {
+        typedef typename std::iterator_traits<InputIt>::value_type T;
+        int n = static_cast<int>(std::distance(first, last));
+        reserve(n);
+        int base = top();
+        for (; first != last; ++first) {
+            if (!VarPusher<T>::push(ptr(), *first)) {
+                settop(base);
+                throw VarPushError();
+            }
+        }
+        return n;
+    }
+
     Table newTable(int narray = 0, int nother = 0) {
-        lua_createtable(ptr(), 0, 0);
+        lua_createtable(ptr(), narray, nother);
         return Table(ptr(), top());
     }
 
+    /* T is constructed in place, aligned even beyond the alignment of lua
+     * blocks. A T with a destructor gets a metatable whose __gc runs it,
+     * setting another metatable drops that: give it userDataGC<T>() as
+     * __gc. */
     template<typename T, typename... Args>
     UserData newUserData(Args&& ... args) {
-        void * buf = lua_newuserdata(ptr(), sizeof(T));
-        new (buf) T(std::forward<Args>(args)...);
+        void* buf = lua_newuserdata(ptr(), sizeof(T) + detail::AlignPad<T>::value);
+        try {
+            new (detail::alignUp(buf, alignof(T))) T(std::forward<Args>(args)...);
+        } catch (...) {
+            pop();
+            throw;
+        }
+        detail::UserDataGC<T>::attach(ptr());
         return UserData(ptr(), -1);
     }
 
+    // the __gc of userdata made by newUserData<T>
+    template<typename T>
+    CFunction userDataGC() { return &detail::UserDataGC<T>::gc; }
+
     Variant<> operator[](int pos) {
         return Variant<>(ptr(), pos);
     }
@@ -997,6 +2458,40 @@ public:
         return Variant<lua_State*, std::string>(ptr(), key);
     }
 
+    Variant<lua_State*, Key> operator[](const Key& key) {
+        return Variant<lua_State*, Key>(ptr(), key);
+    }
+
+    /* the interned key for name, created on first use and kept for the
+     * lifetime of the state; store it for use in hot paths */
+    Key key(const std::string& name) {
+        static const char cache = 0;
+        lua_State* st = ptr();
+        lua_rawgetp(st, LUA_REGISTRYINDEX, &cache);
+        if (lua_isnil(st, -1)) {
+            lua_pop(st, 1);
+            lua_newtable(st);
+            lua_pushvalue(st, -1);
+            lua_rawsetp(st, LUA_REGISTRYINDEX, &cache);
+        }
+        lua_pushlstring(st, name.data(), name.size());
+        lua_rawget(st, -2);
+        int ref;
+        if (lua_isnumber(st, -1)) {
+            ref = static_cast<int>(lua_tointeger(st, -1));
+            lua_pop(st, 2);
+        } else {
+            lua_pop(st, 1);
+            lua_pushlstring(st, name.data(), name.size());
+            lua_pushvalue(st, -1);
+            ref = luaL_ref(st, LUA_REGISTRYINDEX);
+            lua_pushinteger(st, ref);
+            lua_rawset(st, -3);
+            lua_pop(st, 1);
+        }
+        return Key(ref);
+    }
+
     int top() {
         return lua_gettop(ptr());
     }
@@ -1009,6 +2504,50 @@ public:
         luaL_openlibs(ptr());
     }
 
+    // opens one standard library by name, "_G" for the base functions
+    void openlib(const std::string& name) {
+        static const luaL_Reg libs[] = {
+            {"_G", luaopen_base},
+            {LUA_LOADLIBNAME, luaopen_package},
+            {LUA_COLIBNAME, luaopen_coroutine},
+            {LUA_TABLIBNAME, luaopen_table},
+            {LUA_IOLIBNAME, luaopen_io},
+            {LUA_OSLIBNAME, luaopen_os},
+            {LUA_STRLIBNAME, luaopen_string},
+            {LUA_BITLIBNAME, luaopen_bit32},
+            {LUA_MATHLIBNAME, luaopen_math},
+            {LUA_DBLIBNAME, luaopen_debug},
+        };
+        for (const luaL_Reg& lib : libs) {
+            if (name == lib.name) {
+                luaL_requiref(ptr(), lib.name, lib.func, 1);
+                pop();
+                return;
+            }
+        }
+        throw RuntimeError("no standard library " + name);
+    }
+
+    // loader runs on require(name), the package library is opened if needed
+    void preload(const std::string& name, CFunction loader) {
+        luaL_getsubtable(ptr(), LUA_REGISTRYINDEX, "_LOADED");
+        lua_getfield(ptr(), -1, LUA_LOADLIBNAME);
+        if (!lua_istable(ptr(), -1)) {
+            pop(2);
+            openlib(LUA_LOADLIBNAME);
+            luaL_getsubtable(ptr(), LUA_REGISTRYINDEX, "_LOADED");
+            lua_getfield(ptr(), -1, LUA_LOADLIBNAME);
+        }
+        lua_getfield(ptr(), -1, "preload");
+        lua_pushcfunction(ptr(), loader);
+        lua_setfield(ptr(), -2, name.c_str());
+        pop(3);
+    }
+
+    void lazy(const std::string& name, CFunction loader);
+
+    GC gc() { return GC(ptr()); }
+
     void debug() {
         Table debug = open(luaopen_debug);
         (Closure(debug["debug"]))();
@@ -1063,6 +2602,17 @@ public:
     template<typename F>
     Closure newCallable(F func, int extra_upvalues = 0);
 
+    // name identifies the binding in call statistics (LUAMM_CALL_STATS)
+    template<typename F>
+    Closure newCallable(const std::string& name, F func,
+                        int extra_upvalues = 0);
+
+    // several callables under one name, chosen by the arguments' lua types
+    template<typename... F>
+    Closure newOverload(F... funcs);
+
+    Closure newLambda(lua_Lambda lambda, int extra_upvalues = 0);
+
     State(const State& o);
 
     int upvalue(int i) {
@@ -1086,9 +2636,10 @@ public:
         return index > LUAI_FIRSTPSEUDOIDX;
     }
 
-    template<typename Class>
+    // Bases must be bound before, their methods are copied into Class
+    template<typename Class, typename... Bases>
     Class_<Class> class_(const std::string& name) {
-        return Class_<Class>(name, *this);
+        return Class_<Class>(name, *this, detail::TypeList<Bases...>());
     }
 
     virtual ~State() {}
@@ -1103,26 +2654,19 @@ struct MemberFunctionWrapper {
     MemberFunctionWrapper(MemberFuncPtr p) : p(p) {}
 
     decltype( (std::declval<ThisType>().*p)(std::declval<Args>()...) )
-    operator()(State& st, UserData&& self, Args... args) {
-        auto& hidden_this = self.to<ThisType>();
-        return (hidden_this.*p)(std::forward<Args>(args)...);
+    operator()(State&, Self<ThisType> self, Args... args) {
+        return (self.ptr->*p)(std::forward<Args>(args)...);
     }
 };
 
 
 template<template<class, class...> class T, typename Data,
-        typename ParaList, int size = boost::mpl::size<ParaList>::value,
-        typename... Args>
-struct ParameterListTransformer {
-    typedef typename ParameterListTransformer<T, Data,
-        typename boost::mpl::pop_front<ParaList>::type, size - 1,
-        Args...,
-        typename boost::mpl::at_c<ParaList,0>::type>::type type;
-};
+        typename ParaList>
+struct ParameterListTransformer;
 
 template<template<class, class...> class T, typename Data,
-        typename ParaList, typename... Args>
-struct ParameterListTransformer<T, Data, ParaList, 0, Args...> {
+        typename... Args>
+struct ParameterListTransformer<T, Data, TypeList<Args...>> {
     typedef T<Data, Args...> type;
 };
 } // end namespace detail
@@ -1136,43 +2680,39 @@ struct VarProxy<Variant<>> : VarBase {
     }
 };
 
+/* __index and __newindex of classes with attributes. Lookups go to the
+ * tables held as upvalues, computed once when the class is finished:
+ * the metatable for methods, then the accessor of the property.
+ * Classes without readable attributes keep the metatable itself as
+ * __index. With them __index has to be a function: a fallback on the
+ * method table would be called with that table instead of the object,
+ * and a lua function in front of the tables is slower than this one */
 struct ClassAccessorHelper {
-    static int getter(lua_State* _) {
-        State st(_);
-        UserData ud = st[1];
-        Table mtab = ud.getmetatable();
-        lua_pushnil(_);
-        lua_copy(_, 2, -1);
-        lua_gettable(_, mtab.index);
-        if (st[-1].isnil()) {
-            if (!st[2].isstr()) {
-                return 0;
-            }
-            const char *key = st[2];
-            st.push(std::string("get_") + key);
-            lua_gettable(_, mtab.index);
-            if (st[-1].isfun()) {
-                Closure getter = st[-1];
-                getter(ud).call(1);
-                return 1;
-            } else {
-                return 0;
-            }
-        } else {
+    static int getter(lua_State* st) {
+        lua_pushvalue(st, 2);
+        lua_rawget(st, lua_upvalueindex(1));
+        if (!lua_isnil(st, -1)) {
             return 1;
         }
+        lua_pushvalue(st, 2);
+        lua_rawget(st, lua_upvalueindex(2));
+        if (lua_isnil(st, -1)) {
+            return 1;
+        }
+        lua_pushvalue(st, 1);
+        lua_call(st, 1, 1);
+        return 1;
     }
 
-    static int setter(lua_State* _) {
-        State st(_);
-        if (!st[2].isstr()) return 0;
-        UserData ud = st[1];
-        const char *key = st[2];
-        Table mtab = ud.getmetatable();
-        auto setter_candidate = mtab[std::string("set_") + key];
-        if (!setter_candidate.isfun()) return 0;
-        Closure setter = setter_candidate;
-        setter(ud, st[3]);
+    static int setter(lua_State* st) {
+        lua_pushvalue(st, 2);
+        lua_rawget(st, lua_upvalueindex(1));
+        if (lua_isnil(st, -1)) {
+            return 0;
+        }
+        lua_pushvalue(st, 1);
+        lua_pushvalue(st, 3);
+        lua_call(st, 2, 0);
         return 0;
     }
 };
@@ -1183,18 +2723,53 @@ void Class_<Class>::setupAccessor()
     if (!hasReadAttribute && !hasWriteAttribute)
         return;
 
+    // index the get_/set_ functions of the metatable by property name
+    auto scope = state.newScope();
+    lua_State* st = state.ptr();
+    Table getters = state.newTable();
+    Table setters = state.newTable();
+    lua_pushnil(st);
+    while (lua_next(st, mtab.index)) {
+        std::size_t len = 0;
+        const char* key = lua_type(st, -2) == LUA_TSTRING
+                          ? lua_tolstring(st, -2, &len) : nullptr;
+        if (key && len > 4 && lua_isfunction(st, -1)) {
+            if (std::strncmp(key, "get_", 4) == 0) {
+                lua_pushvalue(st, -1);
+                lua_setfield(st, getters.index, key + 4);
+            } else if (std::strncmp(key, "set_", 4) == 0) {
+                lua_pushvalue(st, -1);
+                lua_setfield(st, setters.index, key + 4);
+            }
+        }
+        lua_pop(st, 1);
+    }
+
     if (hasReadAttribute) {
-        mtab["__index"] = Closure(
-            state.push(CClosure(ClassAccessorHelper::getter)));
+        Closure index = state.push(CClosure(ClassAccessorHelper::getter, 2));
+        index[1] = mtab;
+        index[2] = getters;
+        mtab["__index"] = index;
     }
 
     if (hasWriteAttribute) {
-        mtab["__newindex"] = Closure(
-                state.push(CClosure(ClassAccessorHelper::setter)));
+        Closure newindex = state.push(CClosure(ClassAccessorHelper::setter, 1));
+        newindex[1] = setters;
+        mtab["__newindex"] = newindex;
     }
 }
 
 
+namespace detail {
+    template<typename T, bool mut = false>
+    struct ClassArgReader;
+
+    template<typename Class, typename T>
+    struct AttributeGetter;
+}
+
+// members of a bound class type are read as references into the object,
+// read only ones as const references
 template<typename Class>
 template<typename T>
 Class_<Class>& Class_<Class>::attribute(const std::string& name,
@@ -1203,17 +2778,20 @@ Class_<Class>& Class_<Class>::attribute(const std::string& name,
 {
     if (perm & Read) {
         hasReadAttribute = true;
-        mtab[std::string("get_") + name] = state.newCallable([mp](UserData&& ud) {
-            auto& ref = ud.to<Class>();
-            return ref.*mp;
-        });
+        typename detail::AttributeGetter<Class, T>::type getter{
+            mp, !(perm & Write)
+        };
+        mtab[std::string("get_") + name] = state.newCallable(
+            this->name + ".get_" + name, getter);
     }
     if (perm & Write) {
         hasWriteAttribute = true;
         mtab[std::string("set_") + name] = state.newCallable(
+            this->name + ".set_" + name,
             [mp](UserData&& ud, const T& val) {
-                auto& ref = ud.to<Class>();
-                ref.*mp = val;
+                Class* ref = detail::ClassArgReader<Class, true>::read(
+                    ud.state, ud.index, 1);
+                ref->*mp = val;
                 return std::move(ud);
             }
         );
@@ -1227,16 +2805,15 @@ typename std::enable_if<
     std::is_member_function_pointer<T>::value, Class_<Class>&>::type
 Class_<Class>::def(const std::string& method, T method_ptr)
 {
-    typedef typename boost::function_types::parameter_types<T>::type
-        full_para_t;
+    typedef typename detail::FunctionTraits<T>::para_t full_para_t;
     typedef typename std::remove_reference<
-        typename boost::mpl::at_c<full_para_t, 0>::type>::type this_t;
-    typedef typename boost::mpl::pop_front<full_para_t>::type para_t;
+        typename detail::Front<full_para_t>::type>::type this_t;
+    typedef typename detail::PopFront<full_para_t>::type para_t;
     typedef typename detail::ParameterListTransformer<
                 detail::MemberFunctionWrapper,
-                boost::mpl::pair<T, this_t>,
+                detail::Pair<T, this_t>,
                 para_t>::type Wrapper;
-    mtab[method] = state.newCallable(Wrapper(method_ptr));
+    bind(method, Wrapper(method_ptr));
     return *this;
 }
 
@@ -1246,7 +2823,7 @@ typename std::enable_if<
     !std::is_member_function_pointer<T>::value, Class_<Class>&>::type
 Class_<Class>::def(const std::string& method, T callable)
 {
-    mtab[method] = state.newCallable(callable);
+    bind(method, callable);
     return *this;
 }
 
@@ -1254,13 +2831,12 @@ template<typename Class>
 template<typename... Args>
 Class_<Class>& Class_<Class>::init()
 {
-    std::string mkey = std::to_string(uuid);
     Table constructor = state.newTable();
     constructor["__call"] = state.newCallable(
-        [mkey](State& st, Table&& tab, Args&&... args) {
-            UserData ud = st.newUserData<Class>(std::forward<Args>(args)...);
-            ud.setmetatable(mkey);
-            return ud;
+        name + ".new",
+        [](State& st, Table&&, Args&&... args) {
+            detail::newClassObject<Class>(st.ptr(), std::forward<Args>(args)...);
+            return UserData(st.ptr(), -1);
         }
     );
     constructor["__metatable"] = Nil();
@@ -1277,11 +2853,103 @@ Class_<Class>::Class_(const std::string& name, State& state)
     mod["className"] = name;
     mtab["__metatable"] = Nil();
     mtab["__index"] = mtab;
+    mtab["__gc"] = CClosure(detail::classGC);
     state.registry()[std::to_string(uuid)] = mtab;
+    // fast lookup by type for objects created or pushed from c++
+    state.push(mtab);
+    lua_rawsetp(state.ptr(), LUA_REGISTRYINDEX, detail::ClassId<Class>::id());
+    detail::ClassId<Class>::setName(name);
+}
+
+// the methods, accessors and metamethods of Base are flattened into the
+// metatable, so lookups never go through the base metatable
+template<typename Class>
+template<typename Base>
+void Class_<Class>::inherit()
+{
+    static_assert(std::is_base_of<Base, Class>::value,
+                  "not a base class");
+    detail::addBaseClass<Class, Base>();
+
+    auto scope = state.newScope();
+    lua_State* st = state.ptr();
+    detail::pushClassMetatable<Base>(st);
+    int base = lua_gettop(st);
+    lua_pushnil(st);
+    while (lua_next(st, base)) {
+        const char* key = lua_type(st, -2) == LUA_TSTRING
+                          ? lua_tostring(st, -2) : nullptr;
+        if (key && std::strcmp(key, "__index") != 0
+                && std::strcmp(key, "__newindex") != 0
+                && std::strcmp(key, "__gc") != 0
+                && std::strcmp(key, "__metatable") != 0) {
+            if (std::strncmp(key, "get_", 4) == 0) {
+                hasReadAttribute = true;
+            } else if (std::strncmp(key, "set_", 4) == 0) {
+                hasWriteAttribute = true;
+            }
+            lua_pushvalue(st, -2);
+            lua_pushvalue(st, -2);
+            lua_rawset(st, mtab.index);
+        }
+        lua_pop(st, 1);
+    }
 }
 
 inline State::State(const State& o) : ptr_(o.ptr_) {}
 
+// the global name is bound by loader, a luaopen_ like function, when a
+// script reads it first. It is also preloaded if package is open.
+// Replacing the metatable of the global table removes the hook: the
+// modules still pending are loaded again by the next call to lazy(),
+// which wraps the __index in place at that time.
+inline void State::lazy(const std::string& name, CFunction loader)
+{
+    static const char key = 0;
+    auto scope = newScope();
+    lua_State* st = ptr();
+    lua_rawgetp(st, LUA_REGISTRYINDEX, &key);
+    if (lua_isnil(st, -1)) {
+        lua_pop(st, 1);
+        lua_createtable(st, 0, 4);
+        lua_pushvalue(st, -1);
+        lua_rawsetp(st, LUA_REGISTRYINDEX, &key);
+    }
+    int pending = lua_gettop(st);
+
+    // the hook is checked on every call, scripts may have replaced it
+    lua_rawgeti(st, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    if (!lua_getmetatable(st, -1)) {
+        lua_createtable(st, 0, 1);
+        lua_pushvalue(st, -1);
+        lua_setmetatable(st, -3);
+    }
+    lua_getfield(st, -1, "__index");
+    bool hooked = lua_tocfunction(st, -1) == detail::lazyGlobal
+                  && lua_getupvalue(st, -1, 1)
+                  && lua_rawequal(st, -1, pending);
+    lua_settop(st, pending);
+    if (!hooked) {
+        lua_rawgeti(st, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        lua_getmetatable(st, -1);
+        lua_pushvalue(st, -3);
+        lua_getfield(st, -2, "__index");
+        lua_pushcclosure(st, detail::lazyGlobal, 2);
+        lua_setfield(st, -2, "__index");
+        lua_pop(st, 2);
+    }
+    lua_pushcfunction(st, loader);
+    lua_setfield(st, -2, name.c_str());
+
+    luaL_getsubtable(st, LUA_REGISTRYINDEX, "_LOADED");
+    lua_getfield(st, -1, LUA_LOADLIBNAME);
+    if (lua_istable(st, -1)) {
+        lua_getfield(st, -1, "preload");
+        lua_pushcfunction(st, loader);
+        lua_setfield(st, -2, name.c_str());
+    }
+}
+
 class NewState : public State {
 public:
     NewState();
@@ -1369,34 +3037,470 @@ Table detail::HasMetaTable<Sub>::getmetatable() {
     return Table(p->state, -1);
 }
 
-template<typename C, int n>
-struct CallLambda;
+/* an optional trailing argument of a bound callable, it is empty if the
+ * caller passed nil or omitted the argument */
+template<typename T>
+class Optional {
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type buf;
+    bool engaged;
+public:
+    Optional() : engaged(false) {}
+    Optional(T&& v) : engaged(true) { new (&buf) T(std::move(v)); }
+    Optional(Optional&& o) : engaged(o.engaged) {
+        if (engaged) new (&buf) T(std::move(*o));
+    }
+    Optional(const Optional&) = delete;
+    ~Optional() { if (engaged) (**this).~T(); }
+
+    explicit operator bool() const { return engaged; }
+    T& operator*() { return *reinterpret_cast<T*>(&buf); }
+    const T& operator*() const { return *reinterpret_cast<const T*>(&buf); }
+    T* operator->() { return &**this; }
+
+    template<typename U>
+    T value_or(U&& def) const {
+        return engaged ? **this : static_cast<T>(std::forward<U>(def));
+    }
+};
+
+namespace detail {
+    /* read one argument of a bound callable: exactly one lua_type() and one
+     * lua_toX() for each slot, the error message is only built on failure */
+    template<typename T>
+    struct ArgReader {
+        typedef VarProxy<typename VarGetter<T>::type> Getter;
+        static_assert(Getter::tid >= 0, "not a valid type");
+        enum { tid = Getter::tid, required = 1 };
+
+        static bool match(lua_State* st, int index) {
+            return lua_type(st, index) == tid;
+        }
+
+        static T read(lua_State* st, int index, int narg) {
+            int rtid = lua_type(st, index);
+            if (rtid != tid) { throw ArgError(st, narg, tid, rtid); }
+            bool success = false;
+            return VarGetter<T>::get(st, index, success);
+        }
+    };
+
+    template<typename T>
+    struct ArgReader<Optional<T>> {
+        enum { tid = ArgReader<T>::tid, required = 0 };
+
+        static bool match(lua_State* st, int index) {
+            return lua_type(st, index) <= LUA_TNIL || ArgReader<T>::match(st, index);
+        }
+
+        static Optional<T> read(lua_State* st, int index, int narg) {
+            if (lua_type(st, index) <= LUA_TNIL) { return Optional<T>(); }
+            return Optional<T>(ArgReader<T>::read(st, index, narg));
+        }
+    };
+
+    template<typename T>
+    struct HasGetter {
+        enum { value = !std::is_same<typename VarGetter<T>::type,
+                                     PlaceHolder>::value };
+    };
+
+    template<typename T>
+    struct HasPusher {
+        enum { value = !std::is_same<typename VarPusher<T>::type,
+                                     PlaceHolder>::value };
+    };
+
+    /* an object of a Class_ bound type, passed by pointer, by reference or
+     * by value. The type tag of the userdata is validated. */
+    template<typename T, bool mut>
+    struct ClassArgReader {
+        enum { tid = LUA_TUSERDATA, required = 1 };
+
+        static bool match(lua_State* st, int index) {
+            return toClass<T>(st, index) != nullptr
+                && !(mut && classTag(st, index)->holding == Holding::Const);
+        }
+
+        static T* read(lua_State* st, int index, int narg) {
+            T* p = toClass<T>(st, index);
+            if (!p) {
+                throw ArgError(narg, ClassId<T>::name(),
+                               lua_typename(st, lua_type(st, index)));
+            }
+            if (mut && classTag(st, index)->holding == Holding::Const) {
+                throw ArgError(narg, ClassId<T>::name(),
+                               "const " + ClassId<T>::name());
+            }
+            return p;
+        }
+    };
+
+    // the argument may be modified through it
+    template<typename Arg>
+    struct IsMutableArg {
+        typedef typename std::remove_reference<Arg>::type R;
+        enum { value = std::is_pointer<R>::value
+                       ? !std::is_const<typename std::remove_pointer<R>::type>::value
+                       : std::is_reference<Arg>::value && !std::is_const<R>::value };
+    };
+
+    /* a shared_ptr to an object lua holds by shared_ptr, it shares the
+     * ownership with the userdata */
+    template<typename T>
+    struct ArgReader<std::shared_ptr<T>> {
+        enum { tid = LUA_TUSERDATA, required = 1 };
+        typedef typename std::remove_cv<T>::type Class;
+
+        static bool match(lua_State* st, int index) {
+            ClassTag* tag = classTag(st, index);
+            return toClass<Class>(st, index) && tag->holding == Holding::Shared;
+        }
+
+        static std::shared_ptr<T> read(lua_State* st, int index, int narg) {
+            T* p = ClassArgReader<Class>::read(st, index, narg);
+            if (classTag(st, index)->holding != Holding::Shared) {
+                throw ArgError(narg, "shared " + ClassId<Class>::name(),
+                               "unshared object");
+            }
+            auto& holder = *static_cast<std::shared_ptr<void>*>(
+                lua_touserdata(st, index));
+            return std::shared_ptr<T>(holder, p);
+        }
+    };
+
+    template<typename T>
+    struct IsClassArg {
+        enum { value = std::is_class<T>::value && !HasGetter<T>::value };
+    };
+
+    // readers of their own, not objects of a bound class
+    template<typename T>
+    struct IsClassArg<Optional<T>> { enum { value = 0 }; };
+
+    template<typename T>
+    struct IsClassArg<std::shared_ptr<T>> { enum { value = 0 }; };
+
+    /* how an argument is stored while decoding, and passed to the callable */
+    template<typename Arg, typename T = typename std::decay<Arg>::type,
+             int kind = IsClassArg<T>::value ? 1 :
+                        (std::is_pointer<T>::value &&
+                         IsClassArg<typename std::remove_cv<
+                            typename std::remove_pointer<T>::type>::type>::value)
+                        ? 2 : 0>
+    struct ArgTraits {
+        typedef T storage_t;
+        typedef ArgReader<T> reader;
+        static Arg pass(storage_t& v) { return std::forward<Arg>(v); }
+    };
+
+    template<typename Arg, typename T>
+    struct ArgTraits<Arg, T, 1> {
+        static_assert(!std::is_rvalue_reference<Arg>::value,
+                      "bound objects are owned by lua, take them by reference");
+        typedef T* storage_t;
+        typedef ClassArgReader<T, IsMutableArg<Arg>::value> reader;
+        static Arg pass(storage_t& v) { return *v; }
+    };
+
+    template<typename Arg, typename T>
+    struct ArgTraits<Arg, Self<T>, 1> {
+        typedef T* storage_t;
+        typedef ClassArgReader<typename std::remove_cv<T>::type,
+                               !std::is_const<T>::value> reader;
+        static Self<T> pass(storage_t& v) { return Self<T>{v}; }
+    };
+
+    template<typename Arg, typename T>
+    struct ArgTraits<Arg, T, 2> {
+        typedef T storage_t;
+        typedef ClassArgReader<typename std::remove_cv<
+            typename std::remove_pointer<T>::type>::type,
+            IsMutableArg<T>::value> reader;
+        static Arg pass(storage_t& v) { return v; }
+    };
+}
+
+/* the trailing lua arguments of a bound callable, taken as its last
+ * parameter. It is a view of the stack of the call, nothing is copied. */
+class VarArgs {
+    lua_State* state;
+    int first;
+    int count;
+    int narg;
+public:
+    class Arg {
+        lua_State* state;
+        int index_;
+        int narg;
+    public:
+        Arg(lua_State* st, int index, int narg)
+            : state(st), index_(index), narg(narg) {}
+
+        int index() const { return index_; }
+        int type() const { return lua_type(state, index_); }
+        const char* typeName() const { return lua_typename(state, type()); }
+
+        template<typename T>
+        bool is() const {
+            return detail::ArgTraits<T>::reader::match(state, index_);
+        }
 
-template<typename TL, int n>
-struct TypeChecker {
-    typedef typename boost::mpl::at_c<TL, n>::type Elem;
-    typedef VarProxy<typename VarGetter<Elem>::type> Getter;
-    static_assert(Getter::tid >= 0, "not a valid type");
-    static void check(State& st, int offset) {
-        TypeChecker<TL, n-1>::check(st, offset);
-        int rtid = st[n+offset].type();
-        if (rtid != Getter::tid) {
-            st.error(std::string("bad argument#") + std::to_string(n) + " ("
-                     + st.typerepr(Getter::tid) + " expected, got " +
-                     st.typerepr(rtid) + ")");
+        // converted like an argument of the same type, throws ArgError
+        template<typename T>
+        T to() const {
+            typename detail::ArgTraits<T>::storage_t v =
+                detail::ArgTraits<T>::reader::read(state, index_, narg);
+            return detail::ArgTraits<T>::pass(v);
         }
+    };
+
+    class iterator {
+        const VarArgs* args;
+        int i;
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Arg value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Arg* pointer;
+        typedef Arg reference;
+
+        iterator(const VarArgs* args, int i) : args(args), i(i) {}
+        Arg operator*() const { return (*args)[i]; }
+        iterator& operator++() { ++i; return *this; }
+        iterator operator++(int) { iterator it(*this); ++i; return it; }
+        bool operator==(const iterator& o) const { return i == o.i; }
+        bool operator!=(const iterator& o) const { return i != o.i; }
+    };
+
+    VarArgs(lua_State* st, int index, int narg)
+        : state(st), first(index), count(lua_gettop(st) - index + 1),
+          narg(narg) {
+        if (count < 0) { count = 0; }
+    }
+
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // zero based, past the end gives an Arg of type LUA_TNONE
+    Arg operator[](int i) const { return Arg(state, first + i, narg + i); }
+
+    template<typename T>
+    T get(int i) const { return (*this)[i].template to<T>(); }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, count); }
+};
+
+/* the results of a bound callable when their number is only known at run
+ * time. Values pushed on the State after its construction are returned. */
+class MultiResult {
+    mutable State state;
+    int base;
+public:
+    explicit MultiResult(State& st) : state(st), base(st.top()) {}
+
+    template<typename... Args>
+    MultiResult& push(const Args&... values) {
+        state.pushAll(values...);
+        return *this;
     }
+
+    template<typename InputIt>
+    MultiResult& pushRange(InputIt first, InputIt last) {
+        state.pushRange(first, last);
+        return *this;
+    }
+
+    int size() const { return state.top() - base; }
 };
 
+namespace detail {
+    // pushed straight from the member, no copy in between
+    template<typename Class, typename T>
+    struct MemberValue {
+        T Class::*mp;
+        bool readonly;
+        const T& operator()(Self<const Class> self) const {
+            return self.ptr->*mp;
+        }
+    };
+
+    /* a userdata pointing into the object, its uservalue keeps the parent
+     * alive. It is const if the attribute or the parent is. The reference
+     * is made once, then cached in the uservalue of the parent under the
+     * address of the member, so repeated reads allocate nothing. */
+    template<typename Class, typename T>
+    struct MemberRef {
+        T Class::*mp;
+        bool readonly;
+        MultiResult operator()(State& st, UserData&& self) const {
+            MultiResult r(st);
+            lua_State* L = st.ptr();
+            Class* obj = ClassArgReader<Class>::read(L, self.index, 1);
+            T* member = &(obj->*mp);
+            lua_getuservalue(L, self.index);
+            if (lua_istable(L, -1)) {
+                lua_rawgetp(L, -1, member);
+                if (!lua_isnil(L, -1)) {
+                    lua_remove(L, -2);
+                    return r;
+                }
+                lua_pop(L, 1);
+            } else {
+                lua_pop(L, 1);
+                lua_createtable(L, 0, 1);
+                lua_pushvalue(L, -1);
+                lua_setuservalue(L, self.index);
+            }
+
+            bool isconst = readonly
+                || classTag(L, self.index)->holding == Holding::Const;
+            ClassTag* tag;
+            newClassBox<T, T*>(L, isconst ? Holding::Const : Holding::Borrowed,
+                               tag, member);
+            tag->object = member;
+            lua_createtable(L, 1, 0);
+            lua_pushvalue(L, self.index);
+            lua_rawseti(L, -2, 1);
+            lua_setuservalue(L, -2);
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, -3, member);
+            lua_remove(L, -2);
+            return r;
+        }
+    };
+
+    /* a type with a VarProxy of its own is a reference only once it is
+     * bound as a class, before that it is pushed by value */
+    template<typename Class, typename T>
+    struct MemberRefOrValue {
+        T Class::*mp;
+        bool readonly;
+        MultiResult operator()(State& st, UserData&& self) const {
+            lua_State* L = st.ptr();
+            lua_rawgetp(L, LUA_REGISTRYINDEX, ClassId<T>::id());
+            bool bound = lua_istable(L, -1);
+            lua_pop(L, 1);
+            if (bound) {
+                return MemberRef<Class, T>{mp, readonly}(st, std::move(self));
+            }
+            MultiResult r(st);
+            r.push(ClassArgReader<Class>::read(L, self.index, 1)->*mp);
+            return r;
+        }
+    };
+
+    template<typename Class, typename T>
+    struct AttributeGetter {
+        typedef typename std::conditional<!IsClassArg<T>::value,
+            MemberValue<Class, T>,
+            typename std::conditional<HasPusher<T>::value,
+                MemberRefOrValue<Class, T>,
+                MemberRef<Class, T>>::type>::type type;
+    };
+}
+
+namespace detail {
+    template<>
+    struct IsClassArg<VarArgs> { enum { value = 0 }; };
+
+    // matches any number of values, LUA_TNONE marks the signature variadic
+    template<>
+    struct ArgReader<VarArgs> {
+        enum { tid = LUA_TNONE, required = 0 };
+
+        static bool match(lua_State*, int) { return true; }
+
+        static VarArgs read(lua_State* st, int index, int narg) {
+            return VarArgs(st, index, narg);
+        }
+    };
+
+    /* expected lua types of the arguments of a bound callable */
+    struct Signature {
+        std::vector<int> tids;
+        std::vector<char> optional;
+        bool variadic = false;
+        // type test of all arguments starting at offset+1
+        bool (*match)(lua_State*, int);
+
+        int minargs() const {
+            int n = static_cast<int>(optional.size());
+            while (n > 0 && optional[n-1]) { n--; }
+            return n;
+        }
+        int maxargs() const {
+            return variadic ? INT_MAX : static_cast<int>(tids.size());
+        }
+    };
+
+    /* decode the lua arguments of callable C (State& excluded) in one pass,
+     * arguments are read left to right into a tuple, then forwarded */
+    template<typename C, typename... Args>
+    struct ArgDecoder {
+        enum { nargs = sizeof...(Args) };
+
+        template<typename R, int... I>
+        static R call(C& func, State& st, int offset, Seq<I...>) {
+            lua_State* L = st.ptr();
+            std::tuple<typename ArgTraits<Args>::storage_t...> values{
+                ArgTraits<Args>::reader::read(L, offset + I + 1, I + 1)...
+            };
+            (void)L; (void)values;
+#ifdef LUAMM_CALL_STATS
+            callstats::converted() = callstats::clock::now();
+#endif
+            return func(st, ArgTraits<Args>::pass(std::get<I>(values))...);
+        }
+
+        template<typename R>
+        static R call(C& func, State& st, int offset) {
+            return call<R>(func, st, offset,
+                           typename GenSeq<sizeof...(Args)>::type());
+        }
+
+        // type test without conversion, used for choosing among overloads
+        static bool match(lua_State* st, int offset) {
+            bool ok = true;
+            int i = offset;
+            int _[] = { 0, (ok = ok && ArgTraits<Args>::reader
+                                ::match(st, ++i))... };
+            (void)_; (void)i;
+            return ok;
+        }
+
+        static Signature signature() {
+            Signature sig;
+            int tids[] = { LUA_TNONE, ArgTraits<Args>::reader::tid... };
+            char required[] = { 1, ArgTraits<Args>::reader::required... };
+            int fixed = nargs;
+            if (nargs > 0 && tids[nargs] == LUA_TNONE) {
+                sig.variadic = true;
+                fixed--;
+            }
+            for (int i = 1; i <= fixed; i++) {
+                sig.tids.push_back(tids[i]);
+                sig.optional.push_back(!required[i]);
+            }
+            sig.match = &ArgDecoder::match;
+            return sig;
+        }
+    };
+}
+
 template<typename T>
 struct IsSingleReturnValue {
     enum { value = !std::is_same<typename VarPusher<T>::type,
                                  detail::PlaceHolder>::value };
 };
 
+// moved into lua by the assignment of the result
+template<typename T, typename D>
+struct IsSingleReturnValue<std::unique_ptr<T, D>> { enum { value = 1 }; };
+
 template<typename T>
 struct SingleReturn {
-    static void collect(State& st, T&& ret) { st[1] = ret; }
+    static void collect(State& st, T&& ret) { st[1] = std::forward<T>(ret); }
     enum { value = 1 };
 };
 
@@ -1426,43 +3530,42 @@ struct ReturnValue {
     typedef typename std::conditional<IsSingleReturnValue<T>::value,
         SingleReturn<T>,
         MultiReturn<T>>::type type;
-    enum { value = type::value };
+    enum { value = type::value, dynamic = 0 };
     static void collect(State& st, T&& ret) {
         type::collect(st, std::forward<T>(ret));
     }
 };
 
 template<>
-struct ReturnValue<void> { enum { value = 0 }; };
+struct ReturnValue<void> { enum { value = 0, dynamic = 0 }; };
 
-template<typename TL>
-struct TypeChecker<TL, 0> {
-    static void check(State& st, int offset) {}
-};
+// the values are already on the stack, counted after the call
+template<>
+struct ReturnValue<MultiResult> { enum { value = 0, dynamic = 1 }; };
 
 template<typename F>
 struct ToLambda {
     typedef decltype(&F::operator()) lambda_t;
-    typedef typename boost::function_types::parameter_types<
-        lambda_t>::type fullpara_t;
+    typedef typename detail::FunctionTraits<lambda_t>::para_t fullpara_t;
+    typedef typename detail::FunctionTraits<lambda_t>::result_t result_t;
 
     // paramter list, include the leading State
-    typedef typename boost::mpl::pop_front<fullpara_t>::type para_t;
+    typedef typename detail::PopFront<fullpara_t>::type para_t;
 };
 
 template<typename F>
 struct ToLambda<F*> {
     static_assert(std::is_function<F>::value, "F* should be a function pointer");
     typedef F lambda_t;
-    typedef typename boost::function_types::parameter_types<
-        lambda_t>::type para_t;
+    typedef typename detail::FunctionTraits<lambda_t>::para_t para_t;
+    typedef typename detail::FunctionTraits<lambda_t>::result_t result_t;
 };
 
 template<typename Callable>
 struct IsCanonicalCallable {
     enum { value = std::is_same<State&,
-                   typename boost::mpl::at_c<
-                   typename ToLambda<Callable>::para_t, 0>::type>::value };
+                   typename detail::Front<
+                   typename ToLambda<Callable>::para_t>::type>::value };
 };
 
 namespace detail {
@@ -1470,9 +3573,8 @@ namespace detail {
     struct CanonicalWrapper {
         Callable callable;
         CanonicalWrapper(Callable callable) : callable(callable) { }
-        typename boost::function_types::result_type<
-            typename ToLambda<Callable>::lambda_t>::type
-        operator()(State&, Args&&... args) {
+        typename ToLambda<Callable>::result_t
+        operator()(State&, Args... args) {
             return callable(std::forward<Args>(args)...);
         }
     };
@@ -1498,134 +3600,279 @@ struct ToCanonicalCallable {
 template<typename C>
 struct CallableCall {
     typedef typename ToLambda<C>::para_t para_t;
-    typedef typename boost::function_types::result_type<
-        typename ToLambda<C>::lambda_t>::type result_t;
+    typedef typename ToLambda<C>::result_t result_t;
 
     typedef ReturnValue<result_t> RetType;
 
-    typedef boost::mpl::size<para_t> nargs_t;
+    // arguments following the leading State&
+    typedef typename detail::ParameterListTransformer<detail::ArgDecoder, C,
+        typename detail::PopFront<para_t>::type>::type Decoder;
 
     struct NoRet {
-        static void call(C& c, State& st) {
-            CallLambda<C, nargs_t::value>::call(c, st, RetType::value);
+        static int call(C& c, State& st) {
+            Decoder::template call<result_t>(c, st, RetType::value);
+            return 0;
         }
     };
 
     struct HasRet {
-        static void call(C& c, State& st) {
+        static int call(C& c, State& st) {
             RetType::collect(st,
-                CallLambda<C, nargs_t::value>::call(c, st, RetType::value));
+                Decoder::template call<result_t>(c, st, RetType::value));
+            return RetType::value;
         }
     };
 
-    typedef typename std::conditional<RetType::value != 0,
-            HasRet, NoRet>::type Ret;
+    struct DynRet {
+        static int call(C& c, State& st) {
+            return Decoder::template call<result_t>(c, st, 0).size();
+        }
+    };
 
+    typedef typename std::conditional<RetType::dynamic != 0, DynRet,
+        typename std::conditional<RetType::value != 0,
+            HasRet, NoRet>::type>::type Ret;
 
-    static void call(C c, lua_State* st) {
+    // returns the number of results
+    static int call(C c, lua_State* st) {
         State state(st);
-        // type checking
-        TypeChecker<para_t, boost::mpl::size<para_t>::value - 1>
-            ::check(state, RetType::value);
-        Ret::call(c, state);
+        return Ret::call(c, state);
     }
 };
 
-template<typename C>struct  CallLambda<C, 1> {
-static typename CallableCall<C>::result_t call(C& func, State& st, int offset) {
-    return func(st);
-}}; // special case, c function has no argument
-
-#ifndef LUAMM_LAMBDA_PARANUMBER
-#define LUAMM_LAMBDA_PARANUMBER 15
-#endif
-#define LUAMM_ARGPACK(n) st[n + offset - 1]
-#define LUAMM_ARGLIST(z, n, _) LUAMM_ARGPACK(BOOST_PP_ADD(n, 2)),
-#define LUAMM_ARG(n) BOOST_PP_REPEAT(BOOST_PP_SUB(n, 1), LUAMM_ARGLIST, ) LUAMM_ARGPACK(BOOST_PP_INC(n))
-#define LUAMM_TEMPL(_a, n, _b) template<typename C>struct CallLambda<C, n> {\
-    static typename CallableCall<C>::result_t call(C& func, State& st, int offset) {\
-        return func(st, LUAMM_ARG(BOOST_PP_SUB(n,1))); }};
-
-BOOST_PP_REPEAT_FROM_TO(2, LUAMM_LAMBDA_PARANUMBER, LUAMM_TEMPL,)
-#undef LUAMM_ARGPACK
-#undef LUAMM_ARGLIST
-#undef LUAMM_ARG
-#undef LUAMM_TEMPL
-#undef LUAMM_LAMBDA_PARANUMBER
-
-typedef std::function<int(lua_State*)> lua_Lambda;
-
 namespace detail {
     struct NewCallableHelper {
+        // the lambda is never a bound class, skip the tag lookup
         static int luamm_cclosure(lua_State* _)
         {
-            State st(_);
-            UserData ud = st[st.upvalue(1)];
-            auto& lambda = ud.to<lua_Lambda>();
+            void* buf = lua_touserdata(_, lua_upvalueindex(1));
+            auto& lambda = *static_cast<lua_Lambda*>(
+                alignUp(buf, alignof(lua_Lambda)));
             return lambda(_);
         }
-
-        static int luamm_cleanup(lua_State* _)
-        {
-            State st(_);
-            UserData ud = st[1];
-            auto& lambda = ud.to<lua_Lambda>();
-            lambda.~lua_Lambda();
-            return 0;
-        }
     };
 }
 
-template<typename F>
-Closure State::newCallable(F func, int extra_upvalues)
-{
+namespace detail {
+    template<typename F>
+    struct Binder {
+        typedef typename ToCanonicalCallable<F>::type canonical_t;
+        typedef CallableCall<canonical_t> Call;
+        typedef ReturnValue<typename ToLambda<F>::result_t> RetType;
+
+        static lua_Lambda lambda(F func, const std::string& name) {
+            canonical_t canonical_callable(func);
+#ifdef LUAMM_CALL_STATS
+            int id = callstats::Registry::instance().id(name);
+            return [canonical_callable, id](lua_State* st) -> int {
+                callstats::Timer timer(id);
+#else
+            (void)name;
+            return [canonical_callable](lua_State* st) -> int {
+#endif
+                const int rets = RetType::value;
+
+                // a c function starts with LUA_MINSTACK free slots, only
+                // signatures returning more need to grow the stack
+                if (rets + 2 > LUA_MINSTACK && !lua_checkstack(st, rets + 2)) {
+                    return luaL_error(st, "stack overflow");
+                }
 
-    typename ToCanonicalCallable<F>::type canonical_callable(func);
+                // shift +1 to allocate slot for return value
+                for (auto i = 1; i <= rets; i++) {
+                    lua_pushboolean(st, 1);
+                    lua_insert(st, i);
+                }
 
-    typedef ReturnValue<typename CallableCall<F>::result_t> RetType;
-    lua_Lambda lambda = [canonical_callable](lua_State* st) -> int {
-        // allocate a slot for return value
-        State lua(st);
+                bool failed = false;
+                int nresults = rets;
+                try {
+                    nresults = Call::call(canonical_callable, st);
+                } catch (std::exception& e) {
+                    lua_pushstring(st, e.what());
+                    failed = true;
+                }
+#ifdef LUAMM_CALL_STATS
+                timer.finish(failed);
+#endif
+                // raise after the handler so the exception object is destroyed
+                if (failed) { return lua_error(st); }
 
-        const int rets = RetType::value;
+                // a MultiResult left its values on top of the arguments
+                if (RetType::dynamic) { return nresults; }
 
-        // shift +1 to allocate slot for return value
-        for (auto i = 1; i <= rets; i++) {
-            lua_pushboolean(st, 1);
-            lua_insert(st, i);
+                // leave return value one the stack, wipe out other things
+                lua_settop(st, rets);
+                return rets;
+            };
         }
 
-        try {
-        CallableCall<decltype(canonical_callable)>::call(canonical_callable, st);
-        } catch (std::exception& e) {
-            lua.error(e.what());
+        static Signature signature() {
+            return Call::Decoder::signature();
         }
-
-        // leave return value one the stack, wipe out other things
-        lua_settop(st, rets);
-        return rets;
     };
 
-    push(CClosure(detail::NewCallableHelper::luamm_cclosure, 1 + extra_upvalues));
-    Closure cl = this->operator[](-1);
-    UserData ud = newUserData<lua_Lambda>(lambda);
+    /* callables bound under one name. The call is dispatched by a table
+     * computed at bind time, keyed by the number of arguments and their
+     * lua types (4 bits each). Overloads sharing a key, such as ones
+     * taking different bound classes which are all userdata, are tested
+     * in order and the first registered match wins. Variadic overloads
+     * are not indexed, they are tested in order when the table has no
+     * match. */
+    class OverloadSet {
+        enum { max_indexed = 15 };
+        std::vector<lua_Lambda> bodies;
+        std::vector<Signature> signatures;
+        std::vector<int> variadic;
+        std::unordered_map<std::uint64_t, std::vector<int>> table;
+
+        static std::uint64_t slotkey(int slot, int tid) {
+            return static_cast<std::uint64_t>(tid + 1) << (4 * slot + 4);
+        }
 
-    {
-        Table reg = registry();
-        auto gctab = reg["LUAMM_COMMON_GC"];
-        if (!gctab.istab()) {
-            Table mtab = newTable();
-            mtab["__gc"] = CClosure(detail::NewCallableHelper::luamm_cleanup);
-            gctab = mtab;
+        // enumerate the type combinations accepted with n arguments
+        void index(int id, int n, int slot, std::uint64_t key) {
+            const Signature& sig = signatures[id];
+            if (slot == n) {
+                std::vector<int>& ids = table[key];
+                if (ids.empty() || ids.back() != id) { ids.push_back(id); }
+                return;
+            }
+            index(id, n, slot + 1, key | slotkey(slot, sig.tids[slot]));
+            if (sig.optional[slot]) {
+                index(id, n, slot + 1, key | slotkey(slot, LUA_TNIL));
+            }
+        }
+
+        int nomatch(lua_State* st) const {
+            // pushed as one string, any number of arguments fits the stack
+            {
+                int n = lua_gettop(st);
+                std::string msg = "no matching overload for (";
+                for (int i = 1; i <= n; i++) {
+                    msg += lua_typename(st, lua_type(st, i));
+                    if (i != n) { msg += ", "; }
+                }
+                msg += ")";
+                lua_pushlstring(st, msg.data(), msg.size());
+            }
+            return lua_error(st);
+        }
+    public:
+        void add(lua_Lambda body, Signature sig) {
+            int id = static_cast<int>(bodies.size());
+            bodies.push_back(std::move(body));
+            signatures.push_back(std::move(sig));
+            const Signature& s = signatures.back();
+            if (s.variadic) {
+                variadic.push_back(id);
+                return;
+            }
+            for (int n = s.minargs(); n <= s.maxargs() && n <= max_indexed; n++) {
+                index(id, n, 0, static_cast<std::uint64_t>(n));
+            }
+        }
+
+        std::size_t size() const { return bodies.size(); }
+
+        int dispatch(lua_State* st) const {
+            int n = lua_gettop(st);
+            if (n <= max_indexed) {
+                std::uint64_t key = static_cast<std::uint64_t>(n);
+                for (int i = 0; i < n; i++) {
+                    key |= slotkey(i, lua_type(st, i + 1));
+                }
+                auto it = table.find(key);
+                if (it != table.end()) {
+                    const std::vector<int>& ids = it->second;
+                    // a single candidate reports its own argument errors
+                    if (ids.size() == 1) { return bodies[ids[0]](st); }
+                    for (int id : ids) {
+                        if (signatures[id].match(st, 0)) {
+                            return bodies[id](st);
+                        }
+                    }
+                }
+            } else {
+                // too many arguments to be indexed, test one by one
+                for (std::size_t i = 0; i < signatures.size(); i++) {
+                    const Signature& sig = signatures[i];
+                    if (n >= sig.minargs() && n <= sig.maxargs()
+                            && sig.match(st, 0)) {
+                        return bodies[i](st);
+                    }
+                }
+            }
+            for (int id : variadic) {
+                const Signature& sig = signatures[id];
+                if (n >= sig.minargs() && sig.match(st, 0)) {
+                    return bodies[id](st);
+                }
+            }
+            return nomatch(st);
         }
-        Table mtab = gctab;
-        ud.setmetatable(mtab);
+    };
+
+    template<typename F>
+    void addOverload(OverloadSet& set, F func, const std::string& name) {
+        set.add(Binder<F>::lambda(func, name), Binder<F>::signature());
+    }
+
+    inline lua_Lambda overloadLambda(std::shared_ptr<OverloadSet> set) {
+        return [set](lua_State* st) { return set->dispatch(st); };
     }
+}
+
+template<typename F>
+Closure State::newCallable(F func, int extra_upvalues)
+{
+    return newCallable("anonymous", func, extra_upvalues);
+}
+
+template<typename F>
+Closure State::newCallable(const std::string& name, F func, int extra_upvalues)
+{
+    return newLambda(detail::Binder<F>::lambda(func, name), extra_upvalues);
+}
+
+template<typename... F>
+Closure State::newOverload(F... funcs)
+{
+    auto set = std::make_shared<detail::OverloadSet>();
+    int _[] = { 0, (detail::addOverload(*set, funcs, "anonymous"), 0)... };
+    (void)_;
+    return newLambda(detail::overloadLambda(set));
+}
 
+inline Closure State::newLambda(lua_Lambda lambda, int extra_upvalues)
+{
+    push(CClosure(detail::NewCallableHelper::luamm_cclosure, 1 + extra_upvalues));
+    Closure cl = this->operator[](-1);
+    // destroyed from the __gc newUserData sets
+    UserData ud = newUserData<lua_Lambda>(std::move(lambda));
     cl[1] = ud;
     return cl;
 }
 
+// the first binding of a name is a plain callable, binding the name again
+// turns it into an overload set
+template<typename Class>
+template<typename F>
+void Class_<Class>::bind(const std::string& method, F callable)
+{
+    auto& set = overloads[method];
+    if (!set) {
+        set = std::make_shared<detail::OverloadSet>();
+    }
+    std::string qualified = name + "." + method;
+    detail::addOverload(*set, callable, qualified);
+    if (set->size() == 1) {
+        mtab[method] = state.newCallable(qualified, callable);
+    } else {
+        mtab[method] = state.newLambda(detail::overloadLambda(set));
+    }
+}
+
 } // end namespace
 
 #define LUAMM_MODULE(name, state) extern "C" int luaopen_##name(lua_State *state)
@@ -0,0 +1,456 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// byte buffers shared between c++ and lua without copies
+
+#ifndef LUAMM_BUFFER_HPP
+#define LUAMM_BUFFER_HPP
+
+#include "../luamm.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+
+namespace luamm {
+
+/* A handle to a region of bytes, either owned and growable or wrapping
+ * memory owned elsewhere, which is handed back to a release callback once
+ * the last handle is gone. Slices are views sharing the memory of their
+ * parent. Copying a Buffer copies the handle, never the bytes.
+ *
+ * Pushed into lua it becomes a userdata with the methods installed by
+ * Buffer::open(); bound functions take a Buffer argument by value. */
+class Buffer {
+public:
+    typedef std::function<void(char*, std::size_t)> Release;
+
+    explicit Buffer(std::size_t size = 0)
+        : storage(std::make_shared<Storage>()), offset(0), length(0),
+          view(false) {
+        resize(size);
+    }
+
+    // external memory, release(data, size) runs when no handle is left
+    static Buffer wrap(char* data, std::size_t size, Release release = nullptr) {
+        Buffer b;
+        b.storage->data = data;
+        b.storage->size = b.storage->capacity = size;
+        b.storage->owned = false;
+        b.storage->release = std::move(release);
+        return b;
+    }
+
+    char* data() const { return storage->data + offset; }
+
+    std::size_t size() const { return view ? length : storage->size; }
+
+    bool growable() const { return !view && storage->owned; }
+
+    // a view of [pos, pos+len)
+    Buffer slice(std::size_t pos, std::size_t len) const {
+        if (pos > size() || len > size() - pos) {
+            throw std::out_of_range("buffer slice out of range");
+        }
+        Buffer b(*this);
+        b.offset = offset + pos;
+        b.length = len;
+        b.view = true;
+        return b;
+    }
+
+    // new bytes are zeroed, slices of the buffer stay valid
+    void resize(std::size_t n) {
+        if (!growable()) {
+            throw std::logic_error("buffer is not resizable");
+        }
+        if (n > storage->capacity) {
+            reserve(std::max(n, storage->capacity * 2));
+        }
+        if (n > storage->size) {
+            std::memset(storage->data + storage->size, 0, n - storage->size);
+        }
+        storage->size = n;
+    }
+
+    // p may point into this buffer, or a slice of it, resize may move it
+    void append(const char* p, std::size_t n) {
+        std::size_t old = size();
+        const char* base = storage->data;
+        bool inside = base && p >= base && p < base + storage->capacity;
+        std::size_t at = inside ? static_cast<std::size_t>(p - base) : 0;
+        resize(old + n);
+        std::memmove(data() + old, inside ? storage->data + at : p, n);
+    }
+
+    static void open(lua_State* st);
+
+private:
+    struct Storage {
+        char* data = nullptr;
+        std::size_t size = 0, capacity = 0;
+        bool owned = true;
+        Release release;
+
+        ~Storage() {
+            if (owned) {
+                std::free(data);
+            } else if (release) {
+                release(data, size);
+            }
+        }
+    };
+
+    std::shared_ptr<Storage> storage;
+    std::size_t offset, length;
+    bool view;
+
+    void reserve(std::size_t n) {
+        char* p = static_cast<char*>(std::realloc(storage->data, n));
+        if (!p) { throw std::bad_alloc(); }
+        storage->data = p;
+        storage->capacity = n;
+    }
+};
+
+namespace detail {
+    // the metatable of buffer userdata, created by the first push
+    struct BufferLib {
+        static constexpr const char* tname() { return "luamm.Buffer"; }
+
+        static Buffer* check(lua_State* st, int index) {
+            return static_cast<Buffer*>(luaL_checkudata(st, index, tname()));
+        }
+
+        // 1 based position, negative counts from the end
+        static std::size_t position(lua_State* st, int arg, std::size_t size,
+                                    lua_Integer def) {
+            lua_Integer i = luaL_optinteger(st, arg, def);
+            if (i < 0) { i += static_cast<lua_Integer>(size) + 1; }
+            return i < 0 ? 0 : static_cast<std::size_t>(i);
+        }
+
+        // pos is 1 based, the n bytes must be inside the buffer
+        static char* at(lua_State* st, int arg, std::size_t n) {
+            Buffer* b = check(st, 1);
+            lua_Integer pos = luaL_checkinteger(st, arg);
+            if (pos < 1 || static_cast<std::size_t>(pos) > b->size() ||
+                    n > b->size() - static_cast<std::size_t>(pos) + 1) {
+                luaL_argerror(st, arg, "out of range");
+            }
+            return b->data() + pos - 1;
+        }
+
+        static void push(lua_State* st, const Buffer& b) {
+            void* p = lua_newuserdata(st, sizeof(Buffer));
+            new (p) Buffer(b);
+            metatable(st);
+            lua_setmetatable(st, -2);
+        }
+
+        static int gc(lua_State* st) {
+            check(st, 1)->~Buffer();
+            return 0;
+        }
+
+        static int len(lua_State* st) {
+            lua_pushinteger(st, static_cast<lua_Integer>(check(st, 1)->size()));
+            return 1;
+        }
+
+        // [i, j] as in string.sub, without copying
+        static int sub(lua_State* st) {
+            Buffer* b = check(st, 1);
+            std::size_t n = b->size();
+            std::size_t i = position(st, 2, n, 1);
+            std::size_t j = position(st, 3, n, -1);
+            if (i < 1) { i = 1; }
+            if (j > n) { j = n; }
+            std::size_t len = i <= j ? j - i + 1 : 0;
+            push(st, b->slice(len ? i - 1 : 0, len));
+            return 1;
+        }
+
+        // an explicit copy into a lua string
+        static int tostring(lua_State* st) {
+            Buffer* b = check(st, 1);
+            std::size_t n = b->size();
+            std::size_t i = position(st, 2, n, 1);
+            std::size_t j = position(st, 3, n, -1);
+            if (i < 1) { i = 1; }
+            if (j > n) { j = n; }
+            lua_pushlstring(st, b->data() + i - 1, i <= j ? j - i + 1 : 0);
+            return 1;
+        }
+
+        // buf:find(str [, init]), plain search, returns start, end or nil
+        static int find(lua_State* st) {
+            Buffer* b = check(st, 1);
+            std::size_t nlen;
+            const char* needle = luaL_checklstring(st, 2, &nlen);
+            std::size_t init = position(st, 3, b->size(), 1);
+            if (init < 1) { init = 1; }
+            if (init > b->size() + 1) { lua_pushnil(st); return 1; }
+            const char* begin = b->data() + init - 1;
+            const char* end = b->data() + b->size();
+            const char* r = nlen == 1
+                ? static_cast<const char*>(std::memchr(begin, *needle, end - begin))
+                : std::search(begin, end, needle, needle + nlen);
+            if (!r || (r == end && nlen)) { lua_pushnil(st); return 1; }
+            lua_Integer pos = r - b->data() + 1;
+            lua_pushinteger(st, pos);
+            lua_pushinteger(st, pos + static_cast<lua_Integer>(nlen) - 1);
+            return 2;
+        }
+
+        // buf:write(pos, str|buffer), bytes must fit
+        static int write(lua_State* st) {
+            std::size_t n;
+            const char* src;
+            if (Buffer* o = static_cast<Buffer*>(
+                    luaL_testudata(st, 3, tname()))) {
+                src = o->data();
+                n = o->size();
+            } else {
+                src = luaL_checklstring(st, 3, &n);
+            }
+            std::memmove(at(st, 2, n), src, n);
+            lua_settop(st, 1);
+            return 1;
+        }
+
+        static int append(lua_State* st) {
+            Buffer* b = check(st, 1);
+            if (!b->growable()) { return luaL_error(st, "buffer is not growable"); }
+            std::size_t n;
+            const char* src;
+            if (Buffer* o = static_cast<Buffer*>(
+                    luaL_testudata(st, 2, tname()))) {
+                src = o->data();
+                n = o->size();
+            } else {
+                src = luaL_checklstring(st, 2, &n);
+            }
+            bool ok = true;
+            try {
+                b->append(src, n);
+            } catch (std::exception&) {
+                ok = false;
+            }
+            if (!ok) { return luaL_error(st, "not enough memory"); }
+            lua_settop(st, 1);
+            return 1;
+        }
+
+        static int fill(lua_State* st) {
+            Buffer* b = check(st, 1);
+            int c = static_cast<int>(luaL_checkinteger(st, 2));
+            std::memset(b->data(), c, b->size());
+            lua_settop(st, 1);
+            return 1;
+        }
+
+        static std::uint64_t load(const char* p, std::size_t n, bool big) {
+            std::uint64_t v = 0;
+            for (std::size_t i = 0; i < n; i++) {
+                unsigned char c = static_cast<unsigned char>(p[big ? i : n - 1 - i]);
+                v = (v << 8) | c;
+            }
+            return v;
+        }
+
+        static void store(char* p, std::size_t n, std::uint64_t v, bool big) {
+            for (std::size_t i = 0; i < n; i++) {
+                p[big ? n - 1 - i : i] = static_cast<char>(v & 0xff);
+                v >>= 8;
+            }
+        }
+
+        /* buf:getT(pos [, bigendian]) and buf:setT(pos, value [, bigendian])
+         * for the fixed size type T, little endian by default */
+        template<typename T>
+        static int get(lua_State* st) {
+            const char* p = at(st, 2, sizeof(T));
+            std::uint64_t raw = load(p, sizeof(T), lua_toboolean(st, 3) != 0);
+            lua_pushnumber(st, static_cast<lua_Number>(decode<T>(raw)));
+            return 1;
+        }
+
+        template<typename T>
+        static int set(lua_State* st) {
+            char* p = at(st, 2, sizeof(T));
+            lua_Number v = luaL_checknumber(st, 3);
+            store(p, sizeof(T), encode<T>(v), lua_toboolean(st, 4) != 0);
+            lua_settop(st, 1);
+            return 1;
+        }
+
+        template<typename T>
+        static typename std::enable_if<std::is_integral<T>::value, T>::type
+        decode(std::uint64_t raw) {
+            typedef typename std::make_unsigned<T>::type U;
+            U u = static_cast<U>(raw);
+            T v;
+            std::memcpy(&v, &u, sizeof v);
+            return v;
+        }
+
+        template<typename T>
+        static typename std::enable_if<std::is_floating_point<T>::value, T>::type
+        decode(std::uint64_t raw) {
+            typedef typename std::conditional<sizeof(T) == 4,
+                std::uint32_t, std::uint64_t>::type U;
+            U u = static_cast<U>(raw);
+            T v;
+            std::memcpy(&v, &u, sizeof v);
+            return v;
+        }
+
+        template<typename T>
+        static typename std::enable_if<std::is_integral<T>::value,
+                                       std::uint64_t>::type
+        encode(lua_Number n) {
+            // wraps around like a c cast from a wider integer
+            return static_cast<std::uint64_t>(static_cast<std::int64_t>(n));
+        }
+
+        template<typename T>
+        static typename std::enable_if<std::is_floating_point<T>::value,
+                                       std::uint64_t>::type
+        encode(lua_Number n) {
+            typedef typename std::conditional<sizeof(T) == 4,
+                std::uint32_t, std::uint64_t>::type U;
+            T v = static_cast<T>(n);
+            U u;
+            std::memcpy(&u, &v, sizeof u);
+            return u;
+        }
+
+        static int create(lua_State* st) {
+            lua_Integer n = luaL_optinteger(st, 1, 0);
+            luaL_argcheck(st, n >= 0, 1, "negative size");
+            bool ok = true;
+            try {
+                push(st, Buffer(static_cast<std::size_t>(n)));
+            } catch (std::exception&) {
+                ok = false;
+            }
+            if (!ok) { return luaL_error(st, "not enough memory"); }
+            return 1;
+        }
+
+        static int fromstring(lua_State* st) {
+            std::size_t n;
+            const char* s = luaL_checklstring(st, 1, &n);
+            bool ok = true;
+            try {
+                Buffer b;
+                b.append(s, n);
+                push(st, b);
+            } catch (std::exception&) {
+                ok = false;
+            }
+            if (!ok) { return luaL_error(st, "not enough memory"); }
+            return 1;
+        }
+
+        static void metatable(lua_State* st) {
+            if (!luaL_newmetatable(st, tname())) { return; }
+            const luaL_Reg meta[] = {
+                {"__gc", gc}, {"__len", len}, {"__tostring", tostring},
+                {nullptr, nullptr}
+            };
+            luaL_setfuncs(st, meta, 0);
+            const luaL_Reg methods[] = {
+                {"len", len}, {"sub", sub}, {"tostring", tostring},
+                {"find", find}, {"write", write}, {"append", append},
+                {"fill", fill},
+                {"getu8", get<std::uint8_t>}, {"geti8", get<std::int8_t>},
+                {"getu16", get<std::uint16_t>}, {"geti16", get<std::int16_t>},
+                {"getu32", get<std::uint32_t>}, {"geti32", get<std::int32_t>},
+                {"getf32", get<float>}, {"getf64", get<double>},
+                {"setu8", set<std::uint8_t>}, {"seti8", set<std::int8_t>},
+                {"setu16", set<std::uint16_t>}, {"seti16", set<std::int16_t>},
+                {"setu32", set<std::uint32_t>}, {"seti32", set<std::int32_t>},
+                {"setf32", set<float>}, {"setf64", set<double>},
+                {nullptr, nullptr}
+            };
+            luaL_newlib(st, methods);
+            lua_setfield(st, -2, "__index");
+            lua_pushboolean(st, 0);
+            lua_setfield(st, -2, "__metatable");
+        }
+    };
+
+    template<>
+    struct ArgReader<Buffer> {
+        enum { tid = LUA_TUSERDATA, required = 1 };
+
+        static bool match(lua_State* st, int index) {
+            return luaL_testudata(st, index, BufferLib::tname()) != nullptr;
+        }
+
+        static Buffer read(lua_State* st, int index, int narg) {
+            void* p = luaL_testudata(st, index, BufferLib::tname());
+            if (!p) {
+                throw ArgError(narg, "buffer",
+                               lua_typename(st, lua_type(st, index)));
+            }
+            return *static_cast<Buffer*>(p);
+        }
+    };
+}
+
+template<>
+struct VarProxy<Buffer> : VarBase {
+    bool push(const Buffer& b) {
+        detail::BufferLib::push(state, b);
+        return true;
+    }
+
+    Buffer get(int index, bool& success) {
+        void* p = luaL_testudata(state, index, detail::BufferLib::tname());
+        if (!p) { return Buffer(); }
+        success = true;
+        return *static_cast<Buffer*>(p);
+    }
+    enum { tid = LUA_TUSERDATA };
+};
+
+/* pushes the buffer module: new(size), fromstring(s) */
+inline void Buffer::open(lua_State* st) {
+    const luaL_Reg funcs[] = {
+        {"new", detail::BufferLib::create},
+        {"fromstring", detail::BufferLib::fromstring},
+        {nullptr, nullptr}
+    };
+    luaL_newlib(st, funcs);
+}
+
+} // end namespace
+
+#endif
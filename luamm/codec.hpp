@@ -0,0 +1,129 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// shared pieces of the wire format codecs (json.hpp, msgpack.hpp)
+
+#ifndef LUAMM_CODEC_HPP
+#define LUAMM_CODEC_HPP
+
+#include "../luamm.hpp"
+
+#include <cmath>
+#include <cstddef>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace luamm {
+
+/* how lua values map onto the wire formats */
+struct CodecOptions {
+    // {} is written as an empty array instead of an empty map
+    bool emptyAsArray = false;
+    // null decodes to nil instead of the codec null value, nil entries
+    // of arrays then turn into holes
+    bool nullAsNil = false;
+    // nesting limit of tables, deeper input fails
+    int maxDepth = 128;
+};
+
+namespace detail {
+    /* tables with the keys 1..n only are arrays, anything else a map.
+     * count is the number of entries */
+    inline bool isArray(lua_State* st, int index, const CodecOptions& opts,
+                        std::size_t& count) {
+        std::size_t len = lua_rawlen(st, index);
+        count = 0;
+        lua_pushnil(st);
+        while (lua_next(st, index)) {
+            count++;
+            lua_pop(st, 1);
+        }
+        if (count == 0) { return opts.emptyAsArray; }
+        return len == count;
+    }
+
+    // integral numbers which survive a round trip through int64
+    inline bool isInteger(lua_Number n) {
+        return n >= -9223372036854775808.0 && n < 9223372036854775808.0 &&
+               std::floor(n) == n;
+    }
+
+    /* codec null, a light userdata wrapping the null pointer */
+    inline bool isNull(lua_State* st, int index) {
+        return lua_type(st, index) == LUA_TLIGHTUSERDATA &&
+               lua_touserdata(st, index) == nullptr;
+    }
+
+    /* first byte in [p, end) which is a quote, a backslash or a control
+     * character, the bytes that end or interrupt a plain json string */
+    inline const char* scanString(const char* p, const char* end) {
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i slash = _mm_set1_epi8('\\');
+        // unsigned c < 0x20 as a signed compare of c ^ 0x80
+        const __m128i flip = _mm_set1_epi8(static_cast<char>(0x80));
+        const __m128i ctrl = _mm_set1_epi8(static_cast<char>(0x20 ^ 0x80));
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)),
+                _mm_cmplt_epi8(_mm_xor_si128(v, flip), ctrl));
+            int mask = _mm_movemask_epi8(hit);
+            if (mask) {
+#if defined(__GNUC__)
+                return p + __builtin_ctz(mask);
+#else
+                int i = 0;
+                while (!(mask & (1 << i))) { i++; }
+                return p + i;
+#endif
+            }
+            p += 16;
+        }
+#endif
+        for (; p < end; p++) {
+            unsigned char c = static_cast<unsigned char>(*p);
+            if (c == '"' || c == '\\' || c < 0x20) { break; }
+        }
+        return p;
+    }
+
+    /* pushes a lua_CFunction result of a codec, exceptions turn into lua
+     * errors once the handler is left */
+    template<typename F>
+    int protect(lua_State* st, F f) {
+        bool failed = false;
+        try {
+            return f();
+        } catch (std::exception& e) {
+            lua_pushstring(st, e.what());
+            failed = true;
+        }
+        return failed ? lua_error(st) : 0;
+    }
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,525 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// json encoding and decoding straight from and into the lua stack
+
+#ifndef LUAMM_JSON_HPP
+#define LUAMM_JSON_HPP
+
+#include "codec.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace luamm {
+
+/* JSON codec. Encoding walks the lua value in place; decoding parses into
+ * lua values directly, strings without escapes are pushed straight from
+ * the input and small containers are created with their final size. null
+ * maps to Json::null (a null light userdata) unless nullAsNil is set.
+ *
+ *     Json json;
+ *     std::string out;
+ *     json.encode(st, -1, out);
+ *     json.decode(st, out);      // pushes the value
+ */
+class Json {
+public:
+    explicit Json(CodecOptions opts = CodecOptions()) : opts(opts) {}
+
+    static void null(lua_State* st) { lua_pushlightuserdata(st, nullptr); }
+
+    // replaces out with the encoding of the value at index
+    void encode(lua_State* st, int index, std::string& out) {
+        out.clear();
+        this->out = &out;
+        begin = nullptr;
+        write(st, lua_absindex(st, index), 0);
+        this->out = nullptr;
+    }
+
+    std::string encode(lua_State* st, int index) {
+        std::string out;
+        encode(st, index, out);
+        return out;
+    }
+
+    // pushes the decoded value, throws RuntimeError on malformed input
+    void decode(lua_State* st, const char* data, std::size_t len) {
+        int top = lua_gettop(st);
+        begin = pos = data;
+        end = data + len;
+        try {
+            skip();
+            read(st, 0);
+            skip();
+            if (pos != end) { fail("trailing characters"); }
+        } catch (...) {
+            lua_settop(st, top);
+            throw;
+        }
+    }
+
+    void decode(lua_State* st, const std::string& s) {
+        decode(st, s.data(), s.size());
+    }
+
+    /* pushes the lua module {encode=, decode=, null=} using opts */
+    static void open(lua_State* st, CodecOptions opts = CodecOptions());
+
+private:
+    CodecOptions opts;
+    std::string* out = nullptr;
+    std::string scratch;
+    const char* begin = nullptr;
+    const char* pos = nullptr;
+    const char* end = nullptr;
+
+    void fail(const std::string& msg) const {
+        if (begin) {
+            throw RuntimeError("json: " + msg + " at offset " +
+                               std::to_string(pos - begin));
+        }
+        throw RuntimeError("json: " + msg);
+    }
+
+    // encoding
+
+    void number(lua_Number n) {
+        char buf[32];
+        int len;
+        if (detail::isInteger(n) && std::fabs(n) < 1e17) {
+            len = std::snprintf(buf, sizeof buf, "%lld",
+                                static_cast<long long>(n));
+        } else if (std::isfinite(n)) {
+            // the shortest of the two which reads back exactly
+            double d = static_cast<double>(n);
+            len = std::snprintf(buf, sizeof buf, "%.15g", d);
+            if (std::strtod(buf, nullptr) != d) {
+                len = std::snprintf(buf, sizeof buf, "%.17g", d);
+            }
+        } else {
+            fail("cannot encode nan or inf");
+            return;
+        }
+        out->append(buf, len);
+    }
+
+    void string(const char* s, std::size_t n) {
+        static const char hex[] = "0123456789abcdef";
+        const char* end = s + n;
+        out->push_back('"');
+        while (s < end) {
+            const char* plain = detail::scanString(s, end);
+            out->append(s, plain - s);
+            if (plain == end) { break; }
+            unsigned char c = static_cast<unsigned char>(*plain);
+            switch (c) {
+            case '"': out->append("\\\""); break;
+            case '\\': out->append("\\\\"); break;
+            case '\n': out->append("\\n"); break;
+            case '\r': out->append("\\r"); break;
+            case '\t': out->append("\\t"); break;
+            case '\b': out->append("\\b"); break;
+            case '\f': out->append("\\f"); break;
+            default: {
+                char esc[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                out->append(esc, sizeof esc);
+            }
+            }
+            s = plain + 1;
+        }
+        out->push_back('"');
+    }
+
+    void key(lua_State* st, int index) {
+        if (lua_type(st, index) == LUA_TSTRING) {
+            std::size_t n;
+            const char* s = lua_tolstring(st, index, &n);
+            string(s, n);
+        } else if (lua_type(st, index) == LUA_TNUMBER) {
+            // numeric keys of maps become strings
+            out->push_back('"');
+            number(lua_tonumber(st, index));
+            out->push_back('"');
+        } else {
+            fail(std::string("cannot encode a ") +
+                 lua_typename(st, lua_type(st, index)) + " key");
+        }
+    }
+
+    void write(lua_State* st, int index, int depth) {
+        switch (lua_type(st, index)) {
+        case LUA_TNIL:
+            out->append("null");
+            break;
+        case LUA_TBOOLEAN:
+            out->append(lua_toboolean(st, index) ? "true" : "false");
+            break;
+        case LUA_TNUMBER:
+            number(lua_tonumber(st, index));
+            break;
+        case LUA_TSTRING: {
+            std::size_t n;
+            const char* s = lua_tolstring(st, index, &n);
+            string(s, n);
+            break;
+        }
+        case LUA_TLIGHTUSERDATA:
+            if (detail::isNull(st, index)) {
+                out->append("null");
+                break;
+            }
+            // fall through
+        default:
+            if (lua_type(st, index) != LUA_TTABLE) {
+                fail(std::string("cannot encode a ") +
+                     lua_typename(st, lua_type(st, index)));
+            }
+            writeTable(st, index, depth);
+        }
+    }
+
+    void writeTable(lua_State* st, int index, int depth) {
+        if (depth >= opts.maxDepth) { fail("tables nested too deeply"); }
+        luaL_checkstack(st, 3, "json");
+        std::size_t count;
+        if (detail::isArray(st, index, opts, count)) {
+            out->push_back('[');
+            for (std::size_t i = 1; i <= count; i++) {
+                if (i > 1) { out->push_back(','); }
+                lua_rawgeti(st, index, static_cast<int>(i));
+                write(st, lua_gettop(st), depth + 1);
+                lua_pop(st, 1);
+            }
+            out->push_back(']');
+            return;
+        }
+        out->push_back('{');
+        bool first = true;
+        lua_pushnil(st);
+        while (lua_next(st, index)) {
+            if (!first) { out->push_back(','); }
+            first = false;
+            int top = lua_gettop(st);
+            key(st, top - 1);
+            out->push_back(':');
+            write(st, top, depth + 1);
+            lua_pop(st, 1);
+        }
+        out->push_back('}');
+    }
+
+    // decoding
+
+    void skip() {
+        while (pos < end && (*pos == ' ' || *pos == '\n' ||
+                             *pos == '\r' || *pos == '\t')) {
+            pos++;
+        }
+    }
+
+    void expect(const char* word, std::size_t n) {
+        if (static_cast<std::size_t>(end - pos) < n ||
+                std::memcmp(pos, word, n) != 0) {
+            fail("invalid literal");
+        }
+        pos += n;
+    }
+
+    void read(lua_State* st, int depth) {
+        if (pos == end) { fail("unexpected end of input"); }
+        luaL_checkstack(st, 4, "json");
+        switch (*pos) {
+        case '{': readObject(st, depth); break;
+        case '[': readArray(st, depth); break;
+        case '"': readString(st); break;
+        case 't': expect("true", 4); lua_pushboolean(st, 1); break;
+        case 'f': expect("false", 5); lua_pushboolean(st, 0); break;
+        case 'n':
+            expect("null", 4);
+            if (opts.nullAsNil) { lua_pushnil(st); } else { null(st); }
+            break;
+        default: readNumber(st);
+        }
+    }
+
+    void readNumber(lua_State* st) {
+        const char* start = pos;
+        bool neg = pos < end && *pos == '-';
+        if (neg) { pos++; }
+        if (pos == end || *pos < '0' || *pos > '9') { fail("invalid value"); }
+        // integers of up to 15 digits without strtod
+        std::int64_t v = 0;
+        const char* digits = pos;
+        while (pos < end && *pos >= '0' && *pos <= '9') {
+            v = v * 10 + (*pos - '0');
+            pos++;
+            if (pos - digits > 15) { break; }
+        }
+        if (*digits == '0' && pos - digits > 1) { fail("leading zero"); }
+        if (pos == end || (*pos != '.' && *pos != 'e' && *pos != 'E' &&
+                           (*pos < '0' || *pos > '9'))) {
+            lua_pushnumber(st, static_cast<lua_Number>(neg ? -v : v));
+            return;
+        }
+        // general case, the token is copied so strtod stops at its end
+        while (pos < end && (std::strchr("0123456789+-.eE", *pos) && *pos)) {
+            pos++;
+        }
+        scratch.assign(start, pos);
+        char* stop;
+        double d = std::strtod(scratch.c_str(), &stop);
+        if (stop != scratch.c_str() + scratch.size()) { fail("invalid number"); }
+        lua_pushnumber(st, static_cast<lua_Number>(d));
+    }
+
+    static void utf8(std::string& s, std::uint32_t cp) {
+        if (cp < 0x80) {
+            s.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            s.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+            s.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        } else if (cp < 0x10000) {
+            s.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+            s.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            s.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        } else {
+            s.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+            s.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+            s.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            s.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        }
+    }
+
+    std::uint32_t hex4() {
+        if (end - pos < 4) { fail("truncated escape"); }
+        std::uint32_t v = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = *pos++;
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= c - '0';
+            else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+            else fail("bad unicode escape");
+        }
+        return v;
+    }
+
+    void readString(lua_State* st) {
+        pos++;  // opening quote
+        const char* plain = detail::scanString(pos, end);
+        if (plain < end && *plain == '"') {
+            // the common case, no escapes: no intermediate copy
+            lua_pushlstring(st, pos, plain - pos);
+            pos = plain + 1;
+            return;
+        }
+        scratch.clear();
+        for (;;) {
+            scratch.append(pos, plain - pos);
+            pos = plain;
+            if (pos == end) { fail("unterminated string"); }
+            char c = *pos++;
+            if (c == '"') { break; }
+            if (c != '\\') { fail("control character in string"); }
+            if (pos == end) { fail("unterminated string"); }
+            switch (*pos++) {
+            case '"': scratch.push_back('"'); break;
+            case '\\': scratch.push_back('\\'); break;
+            case '/': scratch.push_back('/'); break;
+            case 'b': scratch.push_back('\b'); break;
+            case 'f': scratch.push_back('\f'); break;
+            case 'n': scratch.push_back('\n'); break;
+            case 'r': scratch.push_back('\r'); break;
+            case 't': scratch.push_back('\t'); break;
+            case 'u': {
+                std::uint32_t cp = hex4();
+                if (cp >= 0xd800 && cp < 0xdc00 && end - pos >= 6 &&
+                        pos[0] == '\\' && pos[1] == 'u') {
+                    pos += 2;
+                    std::uint32_t lo = hex4();
+                    if (lo < 0xdc00 || lo >= 0xe000) { fail("bad surrogate pair"); }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                utf8(scratch, cp);
+                break;
+            }
+            default: fail("bad escape");
+            }
+            plain = detail::scanString(pos, end);
+        }
+        lua_pushlstring(st, scratch.data(), scratch.size());
+    }
+
+    /* elements are collected on the stack, up to batch of them, so that
+     * most arrays are created with their final size */
+    enum { batch = 32 };
+
+    void readArray(lua_State* st, int depth) {
+        if (depth >= opts.maxDepth) { fail("nested too deeply"); }
+        pos++;
+        int base = lua_gettop(st);
+        int table = 0;  // stack index of the table once created
+        int n = 0;
+        skip();
+        if (pos < end && *pos == ']') {
+            pos++;
+            lua_createtable(st, 0, 0);
+            return;
+        }
+        for (;;) {
+            skip();
+            read(st, depth + 1);
+            n++;
+            if (table) {
+                lua_rawseti(st, table, n);
+            } else if (n == batch) {
+                flushArray(st, base, n);
+                table = base + 1;
+            }
+            skip();
+            if (pos == end) { fail("unterminated array"); }
+            if (*pos == ',') { pos++; continue; }
+            if (*pos == ']') { pos++; break; }
+            fail("expected , or ]");
+        }
+        if (!table) { flushArray(st, base, n); }
+    }
+
+    // the n values above base become a table
+    static void flushArray(lua_State* st, int base, int n) {
+        lua_createtable(st, n, 0);
+        lua_insert(st, base + 1);
+        for (int i = n; i >= 1; i--) {
+            lua_rawseti(st, base + 1, i);
+        }
+    }
+
+    void readObject(lua_State* st, int depth) {
+        if (depth >= opts.maxDepth) { fail("nested too deeply"); }
+        pos++;
+        int base = lua_gettop(st);
+        int table = 0;
+        int n = 0;
+        skip();
+        if (pos < end && *pos == '}') {
+            pos++;
+            lua_createtable(st, 0, 0);
+            return;
+        }
+        for (;;) {
+            skip();
+            if (pos == end || *pos != '"') { fail("expected a string key"); }
+            readString(st);
+            skip();
+            if (pos == end || *pos != ':') { fail("expected :"); }
+            pos++;
+            skip();
+            read(st, depth + 1);
+            n++;
+            if (table) {
+                lua_rawset(st, table);
+            } else if (n == batch) {
+                flushObject(st, base, n);
+                table = base + 1;
+            }
+            skip();
+            if (pos == end) { fail("unterminated object"); }
+            if (*pos == ',') { pos++; continue; }
+            if (*pos == '}') { pos++; break; }
+            fail("expected , or }");
+        }
+        if (!table) { flushObject(st, base, n); }
+    }
+
+    // the n key/value pairs above base become a table, in input order so
+    // that the last of duplicated keys wins
+    static void flushObject(lua_State* st, int base, int n) {
+        lua_createtable(st, 0, n);
+        lua_insert(st, base + 1);
+        for (int i = 0; i < n; i++) {
+            lua_pushvalue(st, base + 2 + 2 * i);
+            lua_pushvalue(st, base + 3 + 2 * i);
+            lua_rawset(st, base + 1);
+        }
+        lua_settop(st, base + 1);
+    }
+
+    struct Lib {
+        static Json& self(lua_State* st) {
+            return *static_cast<Json*>(lua_touserdata(st, lua_upvalueindex(1)));
+        }
+
+        static int gc(lua_State* st) {
+            static_cast<Json*>(lua_touserdata(st, 1))->~Json();
+            return 0;
+        }
+
+        static int encode(lua_State* st) {
+            luaL_checkany(st, 1);
+            return detail::protect(st, [st]() {
+                Json& json = self(st);
+                json.encode(st, 1, json.scratchOut);
+                lua_pushlstring(st, json.scratchOut.data(),
+                                json.scratchOut.size());
+                return 1;
+            });
+        }
+
+        static int decode(lua_State* st) {
+            std::size_t n;
+            const char* s = luaL_checklstring(st, 1, &n);
+            return detail::protect(st, [st, s, n]() {
+                self(st).decode(st, s, n);
+                return 1;
+            });
+        }
+    };
+    std::string scratchOut;
+};
+
+inline void Json::open(lua_State* st, CodecOptions opts) {
+    lua_createtable(st, 0, 3);
+    // the codec is shared by both functions as a full userdata upvalue
+    void* p = lua_newuserdata(st, sizeof(Json));
+    new (p) Json(opts);
+    lua_createtable(st, 0, 1);
+    lua_pushcfunction(st, Lib::gc);
+    lua_setfield(st, -2, "__gc");
+    lua_setmetatable(st, -2);
+    lua_pushvalue(st, -1);
+    lua_pushcclosure(st, Lib::encode, 1);
+    lua_setfield(st, -3, "encode");
+    lua_pushcclosure(st, Lib::decode, 1);
+    lua_setfield(st, -2, "decode");
+    null(st);
+    lua_setfield(st, -2, "null");
+}
+
+} // end namespace
+
+#endif
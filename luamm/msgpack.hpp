@@ -0,0 +1,351 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// messagepack encoding and decoding straight from and into the lua stack
+
+#ifndef LUAMM_MSGPACK_HPP
+#define LUAMM_MSGPACK_HPP
+
+#include "codec.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace luamm {
+
+/* MessagePack codec. Integral numbers take the smallest integer format,
+ * other numbers float64; strings and bin both decode to lua strings.
+ * Containers carry their size, so decoded tables are created presized.
+ * nil inside arrays encodes as nil, decoded nil follows nullAsNil like the
+ * json codec. Extension types are rejected. */
+class MsgPack {
+public:
+    explicit MsgPack(CodecOptions opts = CodecOptions()) : opts(opts) {}
+
+    // replaces out with the encoding of the value at index
+    void encode(lua_State* st, int index, std::string& out) {
+        out.clear();
+        this->out = &out;
+        write(st, lua_absindex(st, index), 0);
+        this->out = nullptr;
+    }
+
+    std::string encode(lua_State* st, int index) {
+        std::string out;
+        encode(st, index, out);
+        return out;
+    }
+
+    // pushes the decoded value, throws RuntimeError on malformed input
+    void decode(lua_State* st, const char* data, std::size_t len) {
+        int top = lua_gettop(st);
+        pos = reinterpret_cast<const unsigned char*>(data);
+        end = pos + len;
+        try {
+            read(st, 0);
+            if (pos != end) { fail("trailing bytes"); }
+        } catch (...) {
+            lua_settop(st, top);
+            throw;
+        }
+    }
+
+    void decode(lua_State* st, const std::string& s) {
+        decode(st, s.data(), s.size());
+    }
+
+    /* pushes the lua module {encode=, decode=, null=} using opts */
+    static void open(lua_State* st, CodecOptions opts = CodecOptions());
+
+private:
+    CodecOptions opts;
+    std::string* out = nullptr;
+    std::string scratchOut;
+    const unsigned char* pos = nullptr;
+    const unsigned char* end = nullptr;
+
+    static void fail(const std::string& msg) {
+        throw RuntimeError("msgpack: " + msg);
+    }
+
+    // encoding, multi byte values are big endian
+
+    void byte(unsigned char c) { out->push_back(static_cast<char>(c)); }
+
+    void be(std::uint64_t v, int n) {
+        for (int i = n - 1; i >= 0; i--) {
+            byte(static_cast<unsigned char>(v >> (8 * i)));
+        }
+    }
+
+    // head of a str/array/map: fix form, then 8 (str only), 16, 32 bit
+    void head(std::size_t n, unsigned char fix, std::size_t fixmax,
+              unsigned char c8, unsigned char c16, unsigned char c32) {
+        if (n <= fixmax) { byte(static_cast<unsigned char>(fix | n)); }
+        else if (c8 && n <= 0xff) { byte(c8); be(n, 1); }
+        else if (n <= 0xffff) { byte(c16); be(n, 2); }
+        else if (n <= 0xffffffffu) { byte(c32); be(n, 4); }
+        else { fail("object too large"); }
+    }
+
+    void number(lua_Number n) {
+        if (detail::isInteger(n)) {
+            std::int64_t i = static_cast<std::int64_t>(n);
+            if (i >= 0) {
+                std::uint64_t u = static_cast<std::uint64_t>(i);
+                if (u < 0x80) { byte(static_cast<unsigned char>(u)); }
+                else if (u <= 0xff) { byte(0xcc); be(u, 1); }
+                else if (u <= 0xffff) { byte(0xcd); be(u, 2); }
+                else if (u <= 0xffffffffu) { byte(0xce); be(u, 4); }
+                else { byte(0xcf); be(u, 8); }
+            } else {
+                std::uint64_t u = static_cast<std::uint64_t>(i);
+                if (i >= -32) { byte(static_cast<unsigned char>(u)); }
+                else if (i >= -128) { byte(0xd0); be(u, 1); }
+                else if (i >= -32768) { byte(0xd1); be(u, 2); }
+                else if (i >= -2147483648LL) { byte(0xd2); be(u, 4); }
+                else { byte(0xd3); be(u, 8); }
+            }
+            return;
+        }
+        double d = static_cast<double>(n);
+        std::uint64_t bits;
+        std::memcpy(&bits, &d, sizeof bits);
+        byte(0xcb);
+        be(bits, 8);
+    }
+
+    void write(lua_State* st, int index, int depth) {
+        switch (lua_type(st, index)) {
+        case LUA_TNIL:
+            byte(0xc0);
+            break;
+        case LUA_TBOOLEAN:
+            byte(lua_toboolean(st, index) ? 0xc3 : 0xc2);
+            break;
+        case LUA_TNUMBER:
+            number(lua_tonumber(st, index));
+            break;
+        case LUA_TSTRING: {
+            std::size_t n;
+            const char* s = lua_tolstring(st, index, &n);
+            head(n, 0xa0, 31, 0xd9, 0xda, 0xdb);
+            out->append(s, n);
+            break;
+        }
+        case LUA_TTABLE:
+            writeTable(st, index, depth);
+            break;
+        default:
+            if (detail::isNull(st, index)) {
+                byte(0xc0);
+                break;
+            }
+            fail(std::string("cannot encode a ") +
+                 lua_typename(st, lua_type(st, index)));
+        }
+    }
+
+    void writeTable(lua_State* st, int index, int depth) {
+        if (depth >= opts.maxDepth) { fail("tables nested too deeply"); }
+        luaL_checkstack(st, 3, "msgpack");
+        std::size_t count;
+        if (detail::isArray(st, index, opts, count)) {
+            head(count, 0x90, 15, 0, 0xdc, 0xdd);
+            for (std::size_t i = 1; i <= count; i++) {
+                lua_rawgeti(st, index, static_cast<int>(i));
+                write(st, lua_gettop(st), depth + 1);
+                lua_pop(st, 1);
+            }
+            return;
+        }
+        head(count, 0x80, 15, 0, 0xde, 0xdf);
+        lua_pushnil(st);
+        while (lua_next(st, index)) {
+            int top = lua_gettop(st);
+            write(st, top - 1, depth + 1);
+            write(st, top, depth + 1);
+            lua_pop(st, 1);
+        }
+    }
+
+    // decoding
+
+    void need(std::size_t n) {
+        if (static_cast<std::size_t>(end - pos) < n) { fail("truncated data"); }
+    }
+
+    std::uint64_t take(int n) {
+        need(n);
+        std::uint64_t v = 0;
+        for (int i = 0; i < n; i++) { v = (v << 8) | *pos++; }
+        return v;
+    }
+
+    void str(lua_State* st, std::size_t n) {
+        need(n);
+        lua_pushlstring(st, reinterpret_cast<const char*>(pos), n);
+        pos += n;
+    }
+
+    void pushNil(lua_State* st) {
+        if (opts.nullAsNil) { lua_pushnil(st); }
+        else { lua_pushlightuserdata(st, nullptr); }
+    }
+
+    void read(lua_State* st, int depth) {
+        need(1);
+        luaL_checkstack(st, 3, "msgpack");
+        unsigned char c = *pos++;
+        if (c < 0x80) { lua_pushnumber(st, c); return; }
+        if (c >= 0xe0) {
+            lua_pushnumber(st, static_cast<signed char>(c));
+            return;
+        }
+        if ((c & 0xf0) == 0x80) { readMap(st, c & 0x0f, depth); return; }
+        if ((c & 0xf0) == 0x90) { readArray(st, c & 0x0f, depth); return; }
+        if ((c & 0xe0) == 0xa0) { str(st, c & 0x1f); return; }
+        switch (c) {
+        case 0xc0: pushNil(st); break;
+        case 0xc2: lua_pushboolean(st, 0); break;
+        case 0xc3: lua_pushboolean(st, 1); break;
+        case 0xc4: case 0xd9: str(st, take(1)); break;
+        case 0xc5: case 0xda: str(st, take(2)); break;
+        case 0xc6: case 0xdb: str(st, take(4)); break;
+        case 0xca: {
+            std::uint32_t bits = static_cast<std::uint32_t>(take(4));
+            float f;
+            std::memcpy(&f, &bits, sizeof f);
+            lua_pushnumber(st, f);
+            break;
+        }
+        case 0xcb: {
+            std::uint64_t bits = take(8);
+            double d;
+            std::memcpy(&d, &bits, sizeof d);
+            lua_pushnumber(st, static_cast<lua_Number>(d));
+            break;
+        }
+        case 0xcc: lua_pushnumber(st, static_cast<lua_Number>(take(1))); break;
+        case 0xcd: lua_pushnumber(st, static_cast<lua_Number>(take(2))); break;
+        case 0xce: lua_pushnumber(st, static_cast<lua_Number>(take(4))); break;
+        case 0xcf: lua_pushnumber(st, static_cast<lua_Number>(take(8))); break;
+        case 0xd0: lua_pushnumber(st, static_cast<std::int8_t>(take(1))); break;
+        case 0xd1: lua_pushnumber(st, static_cast<std::int16_t>(take(2))); break;
+        case 0xd2: lua_pushnumber(st, static_cast<std::int32_t>(take(4))); break;
+        case 0xd3:
+            lua_pushnumber(st, static_cast<lua_Number>(
+                static_cast<std::int64_t>(take(8))));
+            break;
+        case 0xdc: readArray(st, take(2), depth); break;
+        case 0xdd: readArray(st, take(4), depth); break;
+        case 0xde: readMap(st, take(2), depth); break;
+        case 0xdf: readMap(st, take(4), depth); break;
+        default: fail("unsupported type");
+        }
+    }
+
+    void readArray(lua_State* st, std::uint64_t n, int depth) {
+        if (depth >= opts.maxDepth) { fail("nested too deeply"); }
+        // each element takes a byte at least
+        if (n > static_cast<std::uint64_t>(end - pos)) { fail("truncated data"); }
+        lua_createtable(st, static_cast<int>(n), 0);
+        int t = lua_gettop(st);
+        for (std::uint64_t i = 1; i <= n; i++) {
+            read(st, depth + 1);
+            lua_rawseti(st, t, static_cast<int>(i));
+        }
+    }
+
+    void readMap(lua_State* st, std::uint64_t n, int depth) {
+        if (depth >= opts.maxDepth) { fail("nested too deeply"); }
+        if (n > static_cast<std::uint64_t>(end - pos) / 2) {
+            fail("truncated data");
+        }
+        lua_createtable(st, 0, static_cast<int>(n));
+        int t = lua_gettop(st);
+        for (std::uint64_t i = 0; i < n; i++) {
+            read(st, depth + 1);
+            if (lua_isnil(st, -1) || detail::isNull(st, -1) ||
+                    (lua_type(st, -1) == LUA_TNUMBER &&
+                     std::isnan(lua_tonumber(st, -1)))) {
+                fail("bad map key");
+            }
+            read(st, depth + 1);
+            lua_rawset(st, t);
+        }
+    }
+
+    struct Lib {
+        static MsgPack& self(lua_State* st) {
+            return *static_cast<MsgPack*>(
+                lua_touserdata(st, lua_upvalueindex(1)));
+        }
+
+        static int gc(lua_State* st) {
+            static_cast<MsgPack*>(lua_touserdata(st, 1))->~MsgPack();
+            return 0;
+        }
+
+        static int encode(lua_State* st) {
+            luaL_checkany(st, 1);
+            return detail::protect(st, [st]() {
+                MsgPack& codec = self(st);
+                codec.encode(st, 1, codec.scratchOut);
+                lua_pushlstring(st, codec.scratchOut.data(),
+                                codec.scratchOut.size());
+                return 1;
+            });
+        }
+
+        static int decode(lua_State* st) {
+            std::size_t n;
+            const char* s = luaL_checklstring(st, 1, &n);
+            return detail::protect(st, [st, s, n]() {
+                self(st).decode(st, s, n);
+                return 1;
+            });
+        }
+    };
+};
+
+inline void MsgPack::open(lua_State* st, CodecOptions opts) {
+    lua_createtable(st, 0, 3);
+    void* p = lua_newuserdata(st, sizeof(MsgPack));
+    new (p) MsgPack(opts);
+    lua_createtable(st, 0, 1);
+    lua_pushcfunction(st, Lib::gc);
+    lua_setfield(st, -2, "__gc");
+    lua_setmetatable(st, -2);
+    lua_pushvalue(st, -1);
+    lua_pushcclosure(st, Lib::encode, 1);
+    lua_setfield(st, -3, "encode");
+    lua_pushcclosure(st, Lib::decode, 1);
+    lua_setfield(st, -2, "decode");
+    lua_pushlightuserdata(st, nullptr);
+    lua_setfield(st, -2, "null");
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,604 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// typed numeric arrays with bulk kernels, exposed to lua
+
+#ifndef LUAMM_NUMARRAY_HPP
+#define LUAMM_NUMARRAY_HPP
+
+#include "../luamm.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace luamm {
+
+/* bulk operations on contiguous arrays. The loops keep independent
+ * accumulators and no aliasing between input and output, so that gcc and
+ * clang vectorize them at -O2 -ftree-vectorize / -O3 without intrinsics */
+namespace numeric {
+    // integers are summed as double, which cannot overflow
+    template<typename T>
+    struct Accumulator {
+        typedef typename std::conditional<std::is_integral<T>::value,
+                                          double, T>::type type;
+    };
+
+    template<typename T>
+    typename Accumulator<T>::type sum(const T* a, std::size_t n) {
+        typedef typename Accumulator<T>::type A;
+        A s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += a[i]; s1 += a[i+1]; s2 += a[i+2]; s3 += a[i+3];
+        }
+        for (; i < n; i++) { s0 += a[i]; }
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    template<typename T>
+    typename Accumulator<T>::type dot(const T* a, const T* b, std::size_t n) {
+        typedef typename Accumulator<T>::type A;
+        A s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += A(a[i]) * b[i];     s1 += A(a[i+1]) * b[i+1];
+            s2 += A(a[i+2]) * b[i+2]; s3 += A(a[i+3]) * b[i+3];
+        }
+        for (; i < n; i++) { s0 += A(a[i]) * b[i]; }
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    // n must be positive
+    template<typename T>
+    void minmax(const T* a, std::size_t n, T& lo, T& hi) {
+        T l = a[0], h = a[0];
+        for (std::size_t i = 1; i < n; i++) {
+            l = a[i] < l ? a[i] : l;
+            h = a[i] > h ? a[i] : h;
+        }
+        lo = l;
+        hi = h;
+    }
+
+    // whether a + b and a * b overflow the integer type T
+    template<typename T>
+    bool addOverflows(T a, T b) {
+        return b > 0 ? a > std::numeric_limits<T>::max() - b
+                     : a < std::numeric_limits<T>::min() - b;
+    }
+
+    template<typename T>
+    bool mulOverflows(T a, T b) {
+        const T lo = std::numeric_limits<T>::min();
+        const T hi = std::numeric_limits<T>::max();
+        if (a == 0 || b == 0) return false;
+        if (a > 0) { return b > 0 ? a > hi / b : b < lo / a; }
+        return b > 0 ? a < lo / b : a < hi / b;
+    }
+
+    template<typename T>
+    void scale(T* a, std::size_t n, T k) {
+        for (std::size_t i = 0; i < n; i++) { a[i] *= k; }
+    }
+
+    template<typename T>
+    void add(T* a, std::size_t n, T k) {
+        for (std::size_t i = 0; i < n; i++) { a[i] += k; }
+    }
+
+    // a and b may be the same array
+    template<typename T>
+    void add(T* a, const T* b, std::size_t n) {
+        for (std::size_t i = 0; i < n; i++) { a[i] += b[i]; }
+    }
+
+    enum Compare { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+
+    // mask[i] = 1 where a[i] <op> k, 0 elsewhere
+    template<typename T, typename M>
+    void compare(const T* a, std::size_t n, T k, Compare op, M* mask) {
+        switch (op) {
+        case Less:
+            for (std::size_t i = 0; i < n; i++) { mask[i] = a[i] < k; }
+            break;
+        case LessEqual:
+            for (std::size_t i = 0; i < n; i++) { mask[i] = a[i] <= k; }
+            break;
+        case Greater:
+            for (std::size_t i = 0; i < n; i++) { mask[i] = a[i] > k; }
+            break;
+        case GreaterEqual:
+            for (std::size_t i = 0; i < n; i++) { mask[i] = a[i] >= k; }
+            break;
+        case Equal:
+            for (std::size_t i = 0; i < n; i++) { mask[i] = a[i] == k; }
+            break;
+        case NotEqual:
+            for (std::size_t i = 0; i < n; i++) { mask[i] = a[i] != k; }
+            break;
+        }
+    }
+
+    // out[i] = a[idx[i]], indices must be in range
+    template<typename T, typename I>
+    void gather(const T* a, const I* idx, std::size_t n, T* out) {
+        for (std::size_t i = 0; i < n; i++) { out[i] = a[idx[i]]; }
+    }
+}
+
+template<typename T> struct NumArrayName;
+template<> struct NumArrayName<float> {
+    static const char* get() { return "float32"; } };
+template<> struct NumArrayName<double> {
+    static const char* get() { return "float64"; } };
+template<> struct NumArrayName<std::int32_t> {
+    static const char* get() { return "int32"; } };
+template<> struct NumArrayName<std::int64_t> {
+    static const char* get() { return "int64"; } };
+
+/* a handle to a typed array, owned or a span of memory owned elsewhere
+ * (release runs when the last handle is gone). Copies share the data.
+ * Pushed into lua it becomes a userdata indexed from 1, with the kernels of
+ * luamm::numeric as methods. int64 elements pass through lua_Number and
+ * are exact up to 2^53. */
+template<typename T>
+class NumArray {
+public:
+    typedef T value_type;
+    typedef std::function<void(T*, std::size_t)> Release;
+
+    explicit NumArray(std::size_t n = 0)
+        : storage(std::make_shared<Storage>()) {
+        storage->owned.resize(n);
+        storage->data = storage->owned.data();
+        storage->size = n;
+    }
+
+    NumArray(std::vector<T> values) : storage(std::make_shared<Storage>()) {
+        storage->owned = std::move(values);
+        storage->data = storage->owned.data();
+        storage->size = storage->owned.size();
+    }
+
+    static NumArray wrap(T* data, std::size_t n, Release release = nullptr) {
+        NumArray a;
+        a.storage->data = data;
+        a.storage->size = n;
+        a.storage->release = std::move(release);
+        return a;
+    }
+
+    T* data() const { return storage->data; }
+    std::size_t size() const { return storage->size; }
+    T& operator[](std::size_t i) const { return storage->data[i]; }
+    T* begin() const { return data(); }
+    T* end() const { return data() + size(); }
+
+private:
+    struct Storage {
+        T* data = nullptr;
+        std::size_t size = 0;
+        std::vector<T> owned;
+        Release release;
+        ~Storage() { if (release) { release(data, size); } }
+    };
+    std::shared_ptr<Storage> storage;
+};
+
+typedef NumArray<float> Float32Array;
+typedef NumArray<double> Float64Array;
+typedef NumArray<std::int32_t> Int32Array;
+typedef NumArray<std::int64_t> Int64Array;
+
+namespace detail {
+    template<typename T>
+    struct NumArrayLib {
+        typedef NumArray<T> Array;
+
+        static const char* tname() {
+            static const std::string name =
+                std::string("luamm.NumArray.") + NumArrayName<T>::get();
+            return name.c_str();
+        }
+
+        static Array* test(lua_State* st, int index) {
+            return static_cast<Array*>(luaL_testudata(st, index, tname()));
+        }
+
+        static Array* check(lua_State* st, int index) {
+            return static_cast<Array*>(luaL_checkudata(st, index, tname()));
+        }
+
+        static void push(lua_State* st, const Array& a) {
+            void* p = lua_newuserdata(st, sizeof(Array));
+            new (p) Array(a);
+            metatable(st);
+            lua_setmetatable(st, -2);
+        }
+
+        /* a new owned array of n elements, pushed before being filled so
+         * that a lua error cannot leak it */
+        static T* create(lua_State* st, std::size_t n) {
+            void* p = lua_newuserdata(st, sizeof(Array));
+            bool ok = true;
+            try {
+                new (p) Array(n);
+            } catch (std::exception&) {
+                ok = false;
+            }
+            if (!ok) { luaL_error(st, "not enough memory"); }
+            metatable(st);
+            lua_setmetatable(st, -2);
+            return static_cast<Array*>(p)->data();
+        }
+
+        /* a lua number stored as T. Integer elements are truncated and
+         * must fit in T, NaN and out of range values raise an error */
+        static T tovalue(lua_State* st, lua_Number v, int arg) {
+            return tovalue(st, v, arg, std::is_integral<T>());
+        }
+
+        static T tovalue(lua_State*, lua_Number v, int, std::false_type) {
+            return static_cast<T>(v);
+        }
+
+        static T tovalue(lua_State* st, lua_Number v, int arg, std::true_type) {
+            // both bounds are powers of two, exact as lua numbers
+            const lua_Number lo = static_cast<lua_Number>(
+                std::numeric_limits<T>::min());
+            if (!(v >= lo && v < -lo)) {
+                luaL_argerror(st, arg, "value out of range");
+            }
+            return static_cast<T>(v);
+        }
+
+        static T checkvalue(lua_State* st, int arg) {
+            return tovalue(st, luaL_checknumber(st, arg), arg);
+        }
+
+        static std::size_t checkindex(lua_State* st, Array* a, int arg) {
+            lua_Integer i = luaL_checkinteger(st, arg);
+            if (i < 1 || static_cast<std::size_t>(i) > a->size()) {
+                luaL_argerror(st, arg, "index out of range");
+            }
+            return static_cast<std::size_t>(i - 1);
+        }
+
+        static int gc(lua_State* st) {
+            check(st, 1)->~Array();
+            return 0;
+        }
+
+        static int len(lua_State* st) {
+            lua_pushinteger(st, static_cast<lua_Integer>(check(st, 1)->size()));
+            return 1;
+        }
+
+        // numeric keys are elements, anything else a method
+        static int index(lua_State* st) {
+            Array* a = check(st, 1);
+            if (lua_type(st, 2) == LUA_TNUMBER) {
+                lua_Number k = lua_tonumber(st, 2);
+                if (k >= 1 && k <= a->size()) {
+                    std::size_t i = static_cast<std::size_t>(k);
+                    if (i == k) {
+                        lua_pushnumber(st, static_cast<lua_Number>((*a)[i - 1]));
+                        return 1;
+                    }
+                }
+                lua_pushnil(st);
+                return 1;
+            }
+            lua_pushvalue(st, 2);
+            lua_rawget(st, lua_upvalueindex(1));
+            return 1;
+        }
+
+        static int newindex(lua_State* st) {
+            Array* a = check(st, 1);
+            (*a)[checkindex(st, a, 2)] = checkvalue(st, 3);
+            return 0;
+        }
+
+        static int sum(lua_State* st) {
+            Array* a = check(st, 1);
+            lua_pushnumber(st, static_cast<lua_Number>(
+                numeric::sum(a->data(), a->size())));
+            return 1;
+        }
+
+        // min and max, nil for an empty array
+        static int minmax(lua_State* st) {
+            Array* a = check(st, 1);
+            if (!a->size()) { lua_pushnil(st); lua_pushnil(st); return 2; }
+            T lo, hi;
+            numeric::minmax(a->data(), a->size(), lo, hi);
+            lua_pushnumber(st, static_cast<lua_Number>(lo));
+            lua_pushnumber(st, static_cast<lua_Number>(hi));
+            return 2;
+        }
+
+        static int min(lua_State* st) {
+            minmax(st);
+            lua_pop(st, 1);
+            return 1;
+        }
+
+        static int max(lua_State* st) {
+            return minmax(st) - 1;
+        }
+
+        static int dot(lua_State* st) {
+            Array* a = check(st, 1);
+            Array* b = check(st, 2);
+            luaL_argcheck(st, a->size() == b->size(), 2, "size mismatch");
+            lua_pushnumber(st, static_cast<lua_Number>(
+                numeric::dot(a->data(), b->data(), a->size())));
+            return 1;
+        }
+
+        /* integer arrays are checked before they are modified, a result
+         * out of range raises an error and leaves the array unchanged */
+        template<bool (*overflows)(T, T)>
+        static void checkResults(lua_State* st, const T* a, std::size_t n,
+                                 T k, std::true_type) {
+            for (std::size_t i = 0; i < n; i++) {
+                if (overflows(a[i], k)) { luaL_error(st, "integer overflow"); }
+            }
+        }
+
+        template<bool (*overflows)(T, T)>
+        static void checkResults(lua_State*, const T*, std::size_t, T,
+                                 std::false_type) {}
+
+        static void checkResults(lua_State* st, const T* a, const T* b,
+                                 std::size_t n, std::true_type) {
+            for (std::size_t i = 0; i < n; i++) {
+                if (numeric::addOverflows(a[i], b[i])) {
+                    luaL_error(st, "integer overflow");
+                }
+            }
+        }
+
+        static void checkResults(lua_State*, const T*, const T*, std::size_t,
+                                 std::false_type) {}
+
+        // in place, returns the array
+        static int scale(lua_State* st) {
+            Array* a = check(st, 1);
+            T k = checkvalue(st, 2);
+            checkResults<numeric::mulOverflows<T>>(st, a->data(), a->size(), k,
+                                                   std::is_integral<T>());
+            numeric::scale(a->data(), a->size(), k);
+            lua_settop(st, 1);
+            return 1;
+        }
+
+        // in place, adds a number or an array of the same type and size
+        static int add(lua_State* st) {
+            Array* a = check(st, 1);
+            if (Array* b = test(st, 2)) {
+                luaL_argcheck(st, a->size() == b->size(), 2, "size mismatch");
+                checkResults(st, a->data(), b->data(), a->size(),
+                             std::is_integral<T>());
+                numeric::add(a->data(), b->data(), a->size());
+            } else {
+                T k = checkvalue(st, 2);
+                checkResults<numeric::addOverflows<T>>(st, a->data(), a->size(),
+                                                       k, std::is_integral<T>());
+                numeric::add(a->data(), a->size(), k);
+            }
+            lua_settop(st, 1);
+            return 1;
+        }
+
+        // a:lt(k) ... a:ne(k), an int32 array of 0 and 1
+        template<numeric::Compare op>
+        static int compare(lua_State* st) {
+            Array* a = check(st, 1);
+            T k = checkvalue(st, 2);
+            std::int32_t* mask = NumArrayLib<std::int32_t>::create(st, a->size());
+            numeric::compare(a->data(), a->size(), k, op, mask);
+            return 1;
+        }
+
+        // ascending, NaN last
+        static int sort(lua_State* st) {
+            Array* a = check(st, 1);
+            T* last = a->end();
+            if (std::is_floating_point<T>::value) {
+                last = std::partition(a->begin(), a->end(),
+                                      [](T v) { return v == v; });
+            }
+            std::sort(a->begin(), last);
+            lua_settop(st, 1);
+            return 1;
+        }
+
+        template<typename I>
+        static bool gatherBy(lua_State* st, Array* a) {
+            auto idx = NumArrayLib<I>::test(st, 2);
+            if (!idx) return false;
+            for (I i : *idx) {
+                if (i < 1 || static_cast<std::size_t>(i) > a->size()) {
+                    luaL_argerror(st, 2, "index out of range");
+                }
+            }
+            T* out = create(st, idx->size());
+            const I* p = idx->data();
+            const T* src = a->data();
+            for (std::size_t i = 0; i < idx->size(); i++) {
+                out[i] = src[p[i] - 1];
+            }
+            return true;
+        }
+
+        /* a:gather(indices), indices an int32/int64 array or a table of
+         * 1 based positions, returns a new array */
+        static int gather(lua_State* st) {
+            Array* a = check(st, 1);
+            if (gatherBy<std::int32_t>(st, a) || gatherBy<std::int64_t>(st, a)) {
+                return 1;
+            }
+            luaL_checktype(st, 2, LUA_TTABLE);
+            std::size_t n = lua_rawlen(st, 2);
+            T* out = create(st, n);
+            for (std::size_t i = 0; i < n; i++) {
+                lua_rawgeti(st, 2, static_cast<int>(i + 1));
+                lua_Number k = lua_tonumber(st, -1);
+                lua_pop(st, 1);
+                if (!(k >= 1 && k <= a->size())) {
+                    luaL_argerror(st, 2, "index out of range");
+                }
+                if (k != std::floor(k)) {
+                    luaL_argerror(st, 2, "integer index expected");
+                }
+                out[i] = (*a)[static_cast<std::size_t>(k) - 1];
+            }
+            return 1;
+        }
+
+        static int totable(lua_State* st) {
+            Array* a = check(st, 1);
+            lua_createtable(st, static_cast<int>(a->size()), 0);
+            for (std::size_t i = 0; i < a->size(); i++) {
+                lua_pushnumber(st, static_cast<lua_Number>((*a)[i]));
+                lua_rawseti(st, -2, static_cast<int>(i + 1));
+            }
+            return 1;
+        }
+
+        static int tostring(lua_State* st) {
+            Array* a = check(st, 1);
+            lua_pushfstring(st, "%s[%d]: %p", NumArrayName<T>::get(),
+                            static_cast<int>(a->size()),
+                            static_cast<void*>(a->data()));
+            return 1;
+        }
+
+        // constructor from lua, a size or a table of values
+        static int construct(lua_State* st) {
+            if (lua_type(st, 1) == LUA_TTABLE) {
+                std::size_t n = lua_rawlen(st, 1);
+                T* out = create(st, n);
+                for (std::size_t i = 0; i < n; i++) {
+                    lua_rawgeti(st, 1, static_cast<int>(i + 1));
+                    out[i] = tovalue(st, lua_tonumber(st, -1), 1);
+                    lua_pop(st, 1);
+                }
+                return 1;
+            }
+            lua_Integer n = luaL_optinteger(st, 1, 0);
+            luaL_argcheck(st, n >= 0, 1, "negative size");
+            create(st, static_cast<std::size_t>(n));
+            return 1;
+        }
+
+        static void metatable(lua_State* st) {
+            if (!luaL_newmetatable(st, tname())) { return; }
+            const luaL_Reg meta[] = {
+                {"__gc", gc}, {"__len", len}, {"__newindex", newindex},
+                {"__tostring", tostring},
+                {nullptr, nullptr}
+            };
+            luaL_setfuncs(st, meta, 0);
+            const luaL_Reg methods[] = {
+                {"len", len}, {"sum", sum}, {"min", min}, {"max", max},
+                {"minmax", minmax}, {"dot", dot}, {"scale", scale},
+                {"add", add}, {"sort", sort}, {"gather", gather},
+                {"totable", totable},
+                {"lt", compare<numeric::Less>},
+                {"le", compare<numeric::LessEqual>},
+                {"gt", compare<numeric::Greater>},
+                {"ge", compare<numeric::GreaterEqual>},
+                {"eq", compare<numeric::Equal>},
+                {"ne", compare<numeric::NotEqual>},
+                {nullptr, nullptr}
+            };
+            luaL_newlib(st, methods);
+            lua_pushcclosure(st, index, 1);
+            lua_setfield(st, -2, "__index");
+            lua_pushboolean(st, 0);
+            lua_setfield(st, -2, "__metatable");
+        }
+    };
+
+    template<typename T>
+    struct ArgReader<NumArray<T>> {
+        enum { tid = LUA_TUSERDATA, required = 1 };
+
+        static bool match(lua_State* st, int index) {
+            return NumArrayLib<T>::test(st, index) != nullptr;
+        }
+
+        static NumArray<T> read(lua_State* st, int index, int narg) {
+            auto p = NumArrayLib<T>::test(st, index);
+            if (!p) {
+                throw ArgError(narg, std::string(NumArrayName<T>::get()) + " array",
+                               lua_typename(st, lua_type(st, index)));
+            }
+            return *p;
+        }
+    };
+}
+
+template<typename T>
+struct VarProxy<NumArray<T>> : VarBase {
+    bool push(const NumArray<T>& a) {
+        detail::NumArrayLib<T>::push(state, a);
+        return true;
+    }
+
+    NumArray<T> get(int index, bool& success) {
+        auto p = detail::NumArrayLib<T>::test(state, index);
+        if (!p) { return NumArray<T>(); }
+        success = true;
+        return *p;
+    }
+    enum { tid = LUA_TUSERDATA };
+};
+
+/* pushes the module {float32=, float64=, int32=, int64=}, each taking a
+ * size or a table of values */
+inline void openNumArray(lua_State* st) {
+    const luaL_Reg funcs[] = {
+        {"float32", detail::NumArrayLib<float>::construct},
+        {"float64", detail::NumArrayLib<double>::construct},
+        {"int32", detail::NumArrayLib<std::int32_t>::construct},
+        {"int64", detail::NumArrayLib<std::int64_t>::construct},
+        {nullptr, nullptr}
+    };
+    luaL_newlib(st, funcs);
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,260 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// sampling profiler for the lua code running inside a luamm state
+
+#ifndef LUAMM_PROFILER_HPP
+#define LUAMM_PROFILER_HPP
+
+#include "../luamm.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace luamm {
+
+/* Sampling profiler. A count hook fires every `instructions` vm
+ * instructions, and at most once per `interval` the current lua stack is
+ * recorded into a call tree, weighted by the time elapsed since the
+ * previous sample. Time spent inside c functions is charged to the next
+ * sample. The hook is shared by the coroutines created after start().
+ * A hook installed before start() keeps receiving its events; when it
+ * counts instructions its count is kept, so a Budget running around the
+ * profiler is still charged correctly.
+ */
+class Profiler {
+public:
+    typedef std::chrono::microseconds duration;
+
+    struct FunctionStats {
+        std::string name;
+        duration self;   // time spent in the function itself
+        duration total;  // time spent with the function on the stack
+        std::size_t samples;
+    };
+
+    Profiler(lua_State* st, duration interval = duration(1000),
+             int instructions = 1000)
+        : state(st), interval(interval), instructions(instructions),
+          running(false), prevhook(nullptr), prevmask(0), prevcount(0) {
+        reset();
+    }
+
+    ~Profiler() { stop(); }
+
+    Profiler(const Profiler&) = delete;
+
+    void start() {
+        if (running) return;
+        prevhook = lua_gethook(state);
+        prevmask = lua_gethookmask(state);
+        prevcount = lua_gethookcount(state);
+        lua_pushlightuserdata(state, this);
+        lua_rawsetp(state, LUA_REGISTRYINDEX, key());
+        last = clock::now();
+        int count = prevhook && (prevmask & LUA_MASKCOUNT)
+                  ? prevcount : instructions;
+        lua_sethook(state, &Profiler::hook, prevmask | LUA_MASKCOUNT, count);
+        running = true;
+    }
+
+    // the hook installed before start() is restored
+    void stop() {
+        if (!running) return;
+        lua_sethook(state, prevhook, prevmask, prevcount);
+        lua_pushnil(state);
+        lua_rawsetp(state, LUA_REGISTRYINDEX, key());
+        running = false;
+    }
+
+    void reset() {
+        nodes.assign(1, Node(-1));
+        functions_.clear();
+        frames.clear();
+        frameIndex.clear();
+        nsamples = 0;
+    }
+
+    std::size_t samples() const { return nsamples; }
+
+    // per function statistics, most expensive (self time) first
+    std::vector<FunctionStats> functions() const {
+        std::vector<FunctionStats> r;
+        for (std::size_t i = 0; i < functions_.size(); i++) {
+            const Aggregate& a = functions_[i];
+            r.push_back(FunctionStats{frames[i], duration(a.self),
+                                      duration(a.total), a.samples});
+        }
+        std::sort(r.begin(), r.end(),
+            [](const FunctionStats& a, const FunctionStats& b) {
+                return a.self > b.self;
+            });
+        return r;
+    }
+
+    /* one line per stack, "outer;...;inner microseconds", the input format
+     * of flamegraph.pl and most flame graph viewers */
+    std::string folded() const {
+        std::string out, path;
+        fold(0, path, out);
+        return out;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Node {
+        int frame;
+        std::uint64_t self, total;
+        std::map<int, int> children;
+        Node(int frame) : frame(frame), self(0), total(0) {}
+    };
+
+    struct Aggregate {
+        std::uint64_t self, total;
+        std::size_t samples;
+        std::size_t mark;  // last sample which counted the total
+    };
+
+    lua_State* state;
+    duration interval;
+    int instructions;
+    bool running;
+    lua_Hook prevhook;
+    int prevmask, prevcount;
+    clock::time_point last;
+
+    std::vector<Node> nodes;
+    std::vector<Aggregate> functions_;
+    std::vector<std::string> frames;
+    std::unordered_map<const void*, int> frameIndex;
+    std::size_t nsamples;
+    std::vector<int> stack;
+
+    static const void* key() {
+        static const char k = 0;
+        return &k;
+    }
+
+    static void hook(lua_State* st, lua_Debug* ar) {
+        lua_rawgetp(st, LUA_REGISTRYINDEX, key());
+        Profiler* self = static_cast<Profiler*>(lua_touserdata(st, -1));
+        lua_pop(st, 1);
+        if (!self) return;
+
+        // sample first, the previous hook may raise an error
+        if (ar->event == LUA_HOOKCOUNT) { self->sample(st); }
+        int event = ar->event == LUA_HOOKTAILCALL ? LUA_HOOKCALL : ar->event;
+        if (self->prevhook && (self->prevmask & (1 << event))) {
+            self->prevhook(st, ar);
+        }
+    }
+
+    // identify the function of an active frame, by its address
+    int frame(lua_State* st, lua_Debug& ar) {
+        lua_getinfo(st, "Snf", &ar);
+        const void* fn = lua_topointer(st, -1);
+        lua_pop(st, 1);
+        auto it = frameIndex.find(fn);
+        if (it != frameIndex.end()) return it->second;
+
+        std::string name = ar.name ? ar.name
+                         : (*ar.what == 'm' ? "main chunk" : "?");
+        name += " (";
+        name += ar.short_src;
+        if (ar.linedefined > 0) {
+            name += ":" + std::to_string(ar.linedefined);
+        }
+        name += ")";
+        int id = static_cast<int>(frames.size());
+        frames.push_back(name);
+        functions_.push_back(Aggregate{0, 0, 0, 0});
+        frameIndex[fn] = id;
+        return id;
+    }
+
+    void sample(lua_State* st) {
+        auto now = clock::now();
+        if (now - last < interval) return;
+        std::uint64_t w = std::chrono::duration_cast<duration>(now - last).count();
+        last = now;
+
+        // innermost frame first
+        stack.clear();
+        lua_Debug ar;
+        for (int level = 0; lua_getstack(st, level, &ar); level++) {
+            stack.push_back(frame(st, ar));
+        }
+        if (stack.empty()) return;
+        nsamples++;
+
+        int node = 0;
+        nodes[0].total += w;
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+            auto child = nodes[node].children.find(*it);
+            if (child == nodes[node].children.end()) {
+                int id = static_cast<int>(nodes.size());
+                nodes[node].children[*it] = id;
+                nodes.push_back(Node(*it));
+                node = id;
+            } else {
+                node = child->second;
+            }
+            nodes[node].total += w;
+
+            // recursive functions count once per sample
+            Aggregate& a = functions_[*it];
+            if (a.mark != nsamples) {
+                a.mark = nsamples;
+                a.total += w;
+                a.samples++;
+            }
+        }
+        nodes[node].self += w;
+        functions_[stack.front()].self += w;
+    }
+
+    void fold(int node, std::string& path, std::string& out) const {
+        const Node& n = nodes[node];
+        std::size_t len = path.size();
+        if (n.frame >= 0) {
+            if (!path.empty()) path += ";";
+            path += frames[n.frame];
+            if (n.self) {
+                out += path + " " + std::to_string(n.self) + "\n";
+            }
+        }
+        for (auto& c : n.children) {
+            fold(c.second, path, out);
+        }
+        path.resize(len);
+    }
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,268 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+// sandboxed global environments sharing a read-only base, in one state
+
+#ifndef LUAMM_SANDBOX_HPP
+#define LUAMM_SANDBOX_HPP
+
+#include "../luamm.hpp"
+
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace luamm {
+
+namespace detail {
+    inline int sandboxReadOnly(lua_State* st) {
+        return luaL_error(st, "attempt to modify a read-only table");
+    }
+
+    // the metamethods of a proxy read its copy, held as uservalue
+    inline int sandboxLen(lua_State* st) {
+        lua_getuservalue(st, 1);
+        lua_pushinteger(st, static_cast<lua_Integer>(lua_rawlen(st, -1)));
+        return 1;
+    }
+
+    inline int sandboxNext(lua_State* st) {
+        lua_settop(st, 2);
+        if (lua_next(st, 1)) { return 2; }
+        lua_pushnil(st);
+        return 1;
+    }
+
+    inline int sandboxINext(lua_State* st) {
+        lua_Integer i = luaL_checkinteger(st, 2) + 1;
+        lua_pushinteger(st, i);
+        lua_rawgeti(st, 1, static_cast<int>(i));
+        return lua_isnil(st, -1) ? 1 : 2;
+    }
+
+    inline int sandboxPairs(lua_State* st) {
+        lua_pushcfunction(st, sandboxNext);
+        lua_getuservalue(st, 1);
+        lua_pushnil(st);
+        return 3;
+    }
+
+    inline int sandboxIPairs(lua_State* st) {
+        lua_pushcfunction(st, sandboxINext);
+        lua_getuservalue(st, 1);
+        lua_pushinteger(st, 0);
+        return 3;
+    }
+}
+
+/* the globals shared by sandboxes. Tables such as the libraries are put
+ * behind read-only proxies, nested tables included, so no sandbox can
+ * change them for the others. A proxy is a userdata, which neither the
+ * raw functions nor the table library can write to. It reads a copy of
+ * the raw contents taken when the global is set, and supports indexing,
+ * the length operator, pairs() and ipairs(). */
+class SandboxBase {
+    lua_State* state;
+    int ref;
+public:
+    // globals safe to hand out, they reach neither files nor the
+    // metatables of other types
+    static std::vector<const char*> safeGlobals() {
+        return {"assert", "error", "ipairs", "next", "pairs", "pcall",
+                "select", "tonumber", "tostring", "type", "unpack",
+                "xpcall", "rawequal", "rawlen", "rawget", "print",
+                "string", "table", "math", "coroutine", "bit32"};
+    }
+
+    // copies the named globals of st, missing ones are skipped
+    SandboxBase(lua_State* st, const std::vector<const char*>& globals
+                = safeGlobals())
+        : state(st) {
+        lua_createtable(st, 0, static_cast<int>(globals.size()));
+        for (const char* name : globals) {
+            lua_getglobal(st, name);
+            set(name);
+        }
+        ref = luaL_ref(st, LUA_REGISTRYINDEX);
+    }
+
+    SandboxBase(const SandboxBase&) = delete;
+    ~SandboxBase() { luaL_unref(state, LUA_REGISTRYINDEX, ref); }
+
+    // adds a global of the base
+    template<typename T>
+    void set(const char* name, const T& value) {
+        push();
+        VarPusher<T>::push(state, value);
+        set(name);
+        lua_pop(state, 1);
+    }
+
+    void push() const { lua_rawgeti(state, LUA_REGISTRYINDEX, ref); }
+
+    lua_State* ptr() const { return state; }
+
+private:
+    // pops the value on top into the base table just below
+    void set(const char* name) {
+        if (lua_istable(state, -1)) {
+            lua_createtable(state, 0, 0);
+            pushProxy(-2, lua_gettop(state));
+            lua_replace(state, -3);
+            lua_pop(state, 1);
+        }
+        lua_setfield(state, -2, name);
+    }
+
+    /* pushes the proxy of the table at index. cache maps the tables
+     * already copied to their proxy, so shared and cyclic tables get a
+     * single one */
+    void pushProxy(int index, int cache) {
+        if (!lua_checkstack(state, 8)) {
+            throw RuntimeError("tables nested too deeply");
+        }
+        index = lua_absindex(state, index);
+        lua_pushvalue(state, index);
+        lua_rawget(state, cache);
+        if (!lua_isnil(state, -1)) { return; }
+        lua_pop(state, 1);
+
+        lua_newuserdata(state, 0);
+        int proxy = lua_gettop(state);
+        lua_pushvalue(state, index);
+        lua_pushvalue(state, proxy);
+        lua_rawset(state, cache);
+
+        lua_createtable(state, 0, 0);
+        int copy = lua_gettop(state);
+        lua_pushnil(state);
+        while (lua_next(state, index)) {
+            if (lua_istable(state, -1)) {
+                pushProxy(-1, cache);
+                lua_remove(state, -2);
+            }
+            lua_pushvalue(state, -2);
+            lua_insert(state, -2);
+            lua_rawset(state, copy);
+        }
+
+        const luaL_Reg meta[] = {
+            {"__newindex", detail::sandboxReadOnly},
+            {"__len", detail::sandboxLen},
+            {"__pairs", detail::sandboxPairs},
+            {"__ipairs", detail::sandboxIPairs},
+            {nullptr, nullptr}
+        };
+        lua_createtable(state, 0, 6);
+        luaL_setfuncs(state, meta, 0);
+        lua_pushvalue(state, copy);
+        lua_setfield(state, -2, "__index");
+        lua_pushboolean(state, 0);
+        lua_setfield(state, -2, "__metatable");
+        lua_setmetatable(state, proxy);
+        lua_setuservalue(state, proxy);
+    }
+};
+
+/* a global environment of its own over a SandboxBase. Globals written by
+ * the code running inside stay in the sandbox, reads fall back to the
+ * base. The base table is the __index of the sandbox metatable, so it
+ * stays alive as long as the sandbox even if the SandboxBase is
+ * destroyed first. */
+class Sandbox {
+    lua_State* state;
+    int ref;
+public:
+    explicit Sandbox(const SandboxBase& base) : state(base.ptr()) {
+        lua_createtable(state, 0, 0);
+        lua_createtable(state, 0, 2);
+        base.push();
+        lua_setfield(state, -2, "__index");
+        lua_pushboolean(state, 0);
+        lua_setfield(state, -2, "__metatable");
+        lua_setmetatable(state, -2);
+        lua_pushvalue(state, -1);
+        lua_setfield(state, -2, "_G");
+        ref = luaL_ref(state, LUA_REGISTRYINDEX);
+    }
+
+    Sandbox(const Sandbox&) = delete;
+    Sandbox(Sandbox&& o) : state(o.state), ref(o.ref) { o.state = nullptr; }
+    ~Sandbox() { if (state) { luaL_unref(state, LUA_REGISTRYINDEX, ref); } }
+
+    void push() const { lua_rawgeti(state, LUA_REGISTRYINDEX, ref); }
+
+    // forgets every global written inside the sandbox
+    void reset() {
+        push();
+        lua_pushnil(state);
+        while (lua_next(state, -2)) {
+            lua_pop(state, 1);
+            lua_pushvalue(state, -1);
+            lua_pushnil(state);
+            lua_rawset(state, -4);
+        }
+        lua_pushvalue(state, -1);
+        lua_setfield(state, -2, "_G");
+        lua_pop(state, 1);
+    }
+
+    // fn and the functions sharing its _ENV upvalue now run in the sandbox
+    void apply(Closure& fn) const;
+};
+
+/* the _ENV upvalue of a function, looked up once by name, so switching
+ * the environment of each call is a single upvalue write. Functions
+ * created by the chunk share the upvalue and switch along with it. */
+class EnvSlot {
+    int upvalue;
+
+    static int find(lua_State* st, int index) {
+        for (int i = 1; ; i++) {
+            const char* name = lua_getupvalue(st, index, i);
+            if (!name) { break; }
+            lua_pop(st, 1);
+            if (std::strcmp(name, "_ENV") == 0) { return i; }
+        }
+        throw RuntimeError("function has no _ENV upvalue");
+    }
+public:
+    explicit EnvSlot(const Closure& fn) : upvalue(find(fn.state, fn.index)) {}
+
+    int index() const { return upvalue; }
+
+    void set(Closure& fn, const Sandbox& env) const {
+        env.push();
+        lua_setupvalue(fn.state, fn.index, upvalue);
+    }
+};
+
+inline void Sandbox::apply(Closure& fn) const
+{
+    EnvSlot(fn).set(fn, *this);
+}
+
+} // end namespace
+
+#endif
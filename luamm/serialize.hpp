@@ -0,0 +1,370 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// binary serialization of lua values, for moving data between states
+
+#ifndef LUAMM_SERIALIZE_HPP
+#define LUAMM_SERIALIZE_HPP
+
+#include "../luamm.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace luamm {
+
+/* Compact binary encoding of nil, booleans, numbers, strings, tables and
+ * bound class objects. Tables shared or referenced cyclically are written
+ * once and restored as the same table. Objects of a class_<T> need a pair
+ * of hooks registered with addClass<T>(), they are matched by class name
+ * so the reading state only has to bind the same class.
+ *
+ * A Serializer is reusable, dump() recycles the capacity of its output.
+ *
+ *     Serializer ser;
+ *     std::string buf;
+ *     ser.dump(from.ptr(), -1, buf);
+ *     ser.load(to.ptr(), buf);   // pushes the copy
+ */
+class Serializer {
+public:
+    enum { max_depth = 200 };
+
+    template<typename T>
+    Serializer& addClass(std::function<void(const T&, std::string&)> encode,
+                         std::function<T(const char*, std::size_t)> decode) {
+        const std::string& name = detail::ClassId<T>::name();
+        encoders[detail::ClassId<T>::id()] = ClassCodec{name,
+            [encode](const void* obj, std::string& out) {
+                encode(*static_cast<const T*>(obj), out);
+            }};
+        decoders[name] = [decode](lua_State* st, const char* p, std::size_t n) {
+            detail::newClassObject<T>(st, decode(p, n));
+        };
+        return *this;
+    }
+
+    // replaces the content of out with the encoding of the value at index
+    void dump(lua_State* st, int index, std::string& out) {
+        out.clear();
+        seen.clear();
+        this->out = &out;
+        write(st, lua_absindex(st, index), 0);
+        this->out = nullptr;
+    }
+
+    std::string dump(lua_State* st, int index) {
+        std::string out;
+        dump(st, index, out);
+        return out;
+    }
+
+    // pushes the decoded value, throws RuntimeError on malformed input
+    void load(lua_State* st, const char* data, std::size_t len) {
+        int top = lua_gettop(st);
+        pos = data;
+        end = data + len;
+        nrefs = 0;
+        try {
+            lua_newtable(st);  // tables decoded so far, for back references
+            read(st, top + 1, 0);
+            if (pos != end) { fail("trailing bytes"); }
+            lua_remove(st, top + 1);
+        } catch (...) {
+            lua_settop(st, top);
+            throw;
+        }
+    }
+
+    void load(lua_State* st, const std::string& data) {
+        load(st, data.data(), data.size());
+    }
+
+private:
+    enum Tag : unsigned char {
+        TNil, TFalse, TTrue, TInteger, TDouble, TString, TTable, TRef, TObject
+    };
+
+    struct ClassCodec {
+        std::string name;
+        std::function<void(const void*, std::string&)> encode;
+    };
+
+    std::unordered_map<const void*, ClassCodec> encoders;
+    std::unordered_map<std::string,
+        std::function<void(lua_State*, const char*, std::size_t)>> decoders;
+
+    std::string* out = nullptr;
+    std::unordered_map<const void*, std::uint32_t> seen;
+    std::string scratch;
+    const char* pos = nullptr;
+    const char* end = nullptr;
+    std::uint32_t nrefs = 0;
+
+    static void fail(const std::string& msg) {
+        throw RuntimeError("serialize: " + msg);
+    }
+
+    void tag(Tag t) { out->push_back(static_cast<char>(t)); }
+
+    void varint(std::uint64_t v) {
+        while (v >= 0x80) {
+            out->push_back(static_cast<char>((v & 0x7f) | 0x80));
+            v >>= 7;
+        }
+        out->push_back(static_cast<char>(v));
+    }
+
+    void bytes(const char* p, std::size_t n) {
+        varint(n);
+        out->append(p, n);
+    }
+
+    void number(lua_Number n) {
+        // integral values in a zigzag varint, everything else as raw bits
+        if (n >= -9007199254740992.0 && n <= 9007199254740992.0
+                && std::floor(n) == n && !(n == 0 && std::signbit(n))) {
+            std::int64_t i = static_cast<std::int64_t>(n);
+            tag(TInteger);
+            varint((static_cast<std::uint64_t>(i) << 1) ^
+                   static_cast<std::uint64_t>(i >> 63));
+        } else {
+            double d = static_cast<double>(n);
+            char raw[sizeof d];
+            std::memcpy(raw, &d, sizeof d);
+            tag(TDouble);
+            out->append(raw, sizeof raw);
+        }
+    }
+
+    void write(lua_State* st, int index, int depth) {
+        switch (lua_type(st, index)) {
+        case LUA_TNIL:
+            tag(TNil);
+            break;
+        case LUA_TBOOLEAN:
+            tag(lua_toboolean(st, index) ? TTrue : TFalse);
+            break;
+        case LUA_TNUMBER:
+            number(lua_tonumber(st, index));
+            break;
+        case LUA_TSTRING: {
+            std::size_t n;
+            const char* s = lua_tolstring(st, index, &n);
+            tag(TString);
+            bytes(s, n);
+            break;
+        }
+        case LUA_TTABLE:
+            writeTable(st, index, depth);
+            break;
+        case LUA_TUSERDATA:
+            writeObject(st, index);
+            break;
+        default:
+            fail(std::string("cannot serialize a ") +
+                 lua_typename(st, lua_type(st, index)));
+        }
+    }
+
+    /* array part 1..n first, then the remaining pairs, whose count is
+     * patched in once known */
+    void writeTable(lua_State* st, int index, int depth) {
+        const void* p = lua_topointer(st, index);
+        auto it = seen.find(p);
+        if (it != seen.end()) {
+            tag(TRef);
+            varint(it->second);
+            return;
+        }
+        if (depth >= max_depth) { fail("tables nested too deeply"); }
+        std::uint32_t id = static_cast<std::uint32_t>(seen.size()) + 1;
+        seen[p] = id;
+        luaL_checkstack(st, 3, "serialize");
+
+        std::size_t narr = lua_rawlen(st, index);
+        tag(TTable);
+        varint(narr);
+        std::size_t patch = out->size();
+        out->append(4, '\0');
+
+        for (std::size_t i = 1; i <= narr; i++) {
+            lua_rawgeti(st, index, static_cast<int>(i));
+            write(st, lua_gettop(st), depth + 1);
+            lua_pop(st, 1);
+        }
+
+        std::uint32_t nhash = 0;
+        lua_pushnil(st);
+        while (lua_next(st, index)) {
+            if (lua_type(st, -2) == LUA_TNUMBER) {
+                lua_Number k = lua_tonumber(st, -2);
+                if (k >= 1 && k <= narr && std::floor(k) == k) {
+                    lua_pop(st, 1);
+                    continue;
+                }
+            }
+            int top = lua_gettop(st);
+            write(st, top - 1, depth + 1);
+            write(st, top, depth + 1);
+            nhash++;
+            lua_pop(st, 1);
+        }
+        for (int i = 0; i < 4; i++) {
+            (*out)[patch + i] = static_cast<char>(nhash >> (8 * i));
+        }
+    }
+
+    void writeObject(lua_State* st, int index) {
+        detail::ClassTag* t = detail::classTag(st, index);
+        if (!t || !t->object) { fail("cannot serialize a userdata"); }
+        auto it = encoders.find(t->cls);
+        if (it == encoders.end()) { fail("no serializer for this class"); }
+        scratch.clear();
+        it->second.encode(t->object, scratch);
+        tag(TObject);
+        bytes(it->second.name.data(), it->second.name.size());
+        bytes(scratch.data(), scratch.size());
+    }
+
+    // reading
+
+    void need(std::size_t n) {
+        if (static_cast<std::size_t>(end - pos) < n) { fail("truncated data"); }
+    }
+
+    std::uint64_t readVarint() {
+        std::uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            need(1);
+            unsigned char c = static_cast<unsigned char>(*pos++);
+            v |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+            if (!(c & 0x80)) return v;
+        }
+        fail("bad varint");
+        return 0;
+    }
+
+    const char* readBytes(std::size_t& n) {
+        n = static_cast<std::size_t>(readVarint());
+        need(n);
+        const char* p = pos;
+        pos += n;
+        return p;
+    }
+
+    void read(lua_State* st, int refs, int depth) {
+        need(1);
+        luaL_checkstack(st, 3, "serialize");
+        switch (static_cast<unsigned char>(*pos++)) {
+        case TNil: lua_pushnil(st); break;
+        case TFalse: lua_pushboolean(st, 0); break;
+        case TTrue: lua_pushboolean(st, 1); break;
+        case TInteger: {
+            std::uint64_t z = readVarint();
+            std::int64_t i = static_cast<std::int64_t>(z >> 1) ^
+                             -static_cast<std::int64_t>(z & 1);
+            lua_pushnumber(st, static_cast<lua_Number>(i));
+            break;
+        }
+        case TDouble: {
+            double d;
+            need(sizeof d);
+            std::memcpy(&d, pos, sizeof d);
+            pos += sizeof d;
+            lua_pushnumber(st, static_cast<lua_Number>(d));
+            break;
+        }
+        case TString: {
+            std::size_t n;
+            const char* s = readBytes(n);
+            lua_pushlstring(st, s, n);
+            break;
+        }
+        case TTable:
+            readTable(st, refs, depth);
+            break;
+        case TRef: {
+            std::uint64_t id = readVarint();
+            if (id == 0 || id > nrefs) { fail("bad table reference"); }
+            lua_rawgeti(st, refs, static_cast<int>(id));
+            break;
+        }
+        case TObject: {
+            std::size_t n, len;
+            const char* name = readBytes(n);
+            auto it = decoders.find(std::string(name, n));
+            if (it == decoders.end()) {
+                fail("no deserializer for class " + std::string(name, n));
+            }
+            const char* data = readBytes(len);
+            it->second(st, data, len);
+            break;
+        }
+        default:
+            fail("bad tag");
+        }
+    }
+
+    void readTable(lua_State* st, int refs, int depth) {
+        if (depth >= max_depth) { fail("tables nested too deeply"); }
+        std::uint64_t narr = readVarint();
+        need(4);
+        std::uint32_t nhash = 0;
+        for (int i = 0; i < 4; i++) {
+            nhash |= static_cast<std::uint32_t>(
+                static_cast<unsigned char>(pos[i])) << (8 * i);
+        }
+        pos += 4;
+        // every entry takes one byte at least, bounds the preallocation
+        if (narr > static_cast<std::size_t>(end - pos) ||
+                nhash > static_cast<std::size_t>(end - pos)) {
+            fail("truncated data");
+        }
+        lua_createtable(st, static_cast<int>(narr), static_cast<int>(nhash));
+        int t = lua_gettop(st);
+        lua_pushvalue(st, t);
+        lua_rawseti(st, refs, static_cast<int>(++nrefs));
+
+        for (std::uint64_t i = 1; i <= narr; i++) {
+            read(st, refs, depth + 1);
+            lua_rawseti(st, t, static_cast<int>(i));
+        }
+        for (std::uint32_t i = 0; i < nhash; i++) {
+            read(st, refs, depth + 1);
+            if (lua_isnil(st, -1) || (lua_type(st, -1) == LUA_TNUMBER &&
+                    std::isnan(lua_tonumber(st, -1)))) {
+                fail("bad table key");
+            }
+            read(st, refs, depth + 1);
+            lua_rawset(st, t);
+        }
+    }
+};
+
+} // end namespace
+
+#endif
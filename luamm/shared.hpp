@@ -0,0 +1,480 @@
+// Copyright (c) 2014 Hao Fei <mrfeihao@gmail.com>
+// this file is part of luamm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// immutable data built once per process and read by every lua state
+
+#ifndef LUAMM_SHARED_HPP
+#define LUAMM_SHARED_HPP
+
+#include "../luamm.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace luamm {
+
+/* a mutable tree describing the content of a SharedData: nil, booleans,
+ * numbers, strings, arrays and string keyed maps */
+class SharedValue {
+public:
+    enum Type : std::uint8_t { Nil, Boolean, Number, String, Array, Map };
+
+    SharedValue() : type_(Nil), num(0) {}
+    SharedValue(bool b) : type_(Boolean), num(b) {}
+    SharedValue(double n) : type_(Number), num(n) {}
+    SharedValue(int n) : type_(Number), num(n) {}
+    SharedValue(const char* s) : type_(String), num(0), str(s) {}
+    SharedValue(std::string s) : type_(String), num(0), str(std::move(s)) {}
+
+    static SharedValue array(std::initializer_list<SharedValue> items = {}) {
+        SharedValue v;
+        v.type_ = Array;
+        v.items.assign(items.begin(), items.end());
+        return v;
+    }
+
+    static SharedValue map(
+            std::initializer_list<std::pair<std::string, SharedValue>> f = {}) {
+        SharedValue v;
+        v.type_ = Map;
+        v.fields.assign(f.begin(), f.end());
+        return v;
+    }
+
+    // converts a lua value, tables must be sequences or have string keys
+    static SharedValue fromLua(lua_State* st, int index, int depth = 0);
+
+    SharedValue& push(SharedValue v) {
+        items.push_back(std::move(v));
+        return *this;
+    }
+
+    // later settings of a key win
+    SharedValue& set(std::string key, SharedValue v) {
+        fields.emplace_back(std::move(key), std::move(v));
+        return *this;
+    }
+
+    Type type() const { return type_; }
+
+private:
+    friend class SharedData;
+    Type type_;
+    double num;
+    std::string str;
+    std::vector<SharedValue> items;
+    std::vector<std::pair<std::string, SharedValue>> fields;
+};
+
+/* A compact, read-only copy of a SharedValue tree: nodes in one array,
+ * all strings in one pool and every map an open addressing hash table.
+ * Once built it is never modified, so one instance can back any number of
+ * lua states on any threads. pushShared() exposes it to a state as a
+ * userdata supporting indexing, # and pairs; scalars come out as lua
+ * values, nested maps and arrays as further read-only userdata.
+ *
+ *     static auto config = std::make_shared<const SharedData>(tree);
+ *     pushShared(lua.ptr(), config);
+ *     lua_setglobal(lua.ptr(), "config");
+ */
+class SharedData {
+public:
+    typedef std::uint32_t NodeId;
+
+    explicit SharedData(const SharedValue& root) { build(root); }
+
+    SharedData(const SharedData&) = delete;
+
+    struct Node {
+        double num;
+        // string: pool offset and length; array: first child and count;
+        // map: first slot and capacity (a power of 2), c the entry count
+        std::uint32_t a, b, c;
+        SharedValue::Type type;
+    };
+
+    const Node& node(NodeId id) const { return nodes[id]; }
+
+    const char* string(const Node& n) const { return pool.data() + n.a; }
+
+    // child i (0 based) of an array
+    NodeId item(const Node& n, std::size_t i) const { return children[n.a + i]; }
+
+    // value of key in a map, 0 (the nil node) if absent
+    NodeId find(const Node& n, const char* key, std::size_t len) const {
+        if (n.type != SharedValue::Map || !n.b) return 0;
+        std::uint32_t h = hash(key, len);
+        std::uint32_t mask = n.b - 1;
+        for (std::uint32_t i = h & mask;; i = (i + 1) & mask) {
+            const Slot& s = slots[n.a + i];
+            if (s.value == 0) return 0;
+            if (s.hash == h && s.keylen == len &&
+                    std::memcmp(pool.data() + s.keyoff, key, len) == 0) {
+                return s.value;
+            }
+        }
+    }
+
+    // the i-th occupied slot of a map at or after position pos, or false
+    bool next(const Node& n, std::uint32_t& pos, const char*& key,
+              std::size_t& len, NodeId& value) const {
+        for (; pos < n.b; pos++) {
+            const Slot& s = slots[n.a + pos];
+            if (s.value) {
+                key = pool.data() + s.keyoff;
+                len = s.keylen;
+                value = s.value;
+                pos++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    NodeId root() const { return 1; }
+
+    // bytes used by the compiled representation
+    std::size_t memory() const {
+        return nodes.capacity() * sizeof(Node) + pool.capacity() +
+               children.capacity() * sizeof(NodeId) +
+               slots.capacity() * sizeof(Slot);
+    }
+
+private:
+    struct Slot {
+        std::uint32_t keyoff, keylen, hash;
+        NodeId value;  // 0 for an empty slot
+    };
+
+    std::vector<Node> nodes;
+    std::string pool;
+    std::vector<NodeId> children;
+    std::vector<Slot> slots;
+
+    static std::uint32_t hash(const char* s, std::size_t n) {
+        std::uint32_t h = 2166136261u;
+        for (std::size_t i = 0; i < n; i++) {
+            h = (h ^ static_cast<unsigned char>(s[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    std::uint32_t intern(const std::string& s) {
+        std::uint32_t off = static_cast<std::uint32_t>(pool.size());
+        pool += s;
+        return off;
+    }
+
+    void build(const SharedValue& root) {
+        nodes.push_back(Node{0, 0, 0, 0, SharedValue::Nil});  // the nil node
+        nodes.push_back(Node{0, 0, 0, 0, SharedValue::Nil});
+        compile(root, 1);
+        nodes.shrink_to_fit();
+        pool.shrink_to_fit();
+        children.shrink_to_fit();
+        slots.shrink_to_fit();
+    }
+
+    void compile(const SharedValue& v, NodeId id) {
+        Node n{v.num, 0, 0, 0, v.type_};
+        switch (v.type_) {
+        case SharedValue::String:
+            n.a = intern(v.str);
+            n.b = static_cast<std::uint32_t>(v.str.size());
+            break;
+        case SharedValue::Array: {
+            n.a = static_cast<std::uint32_t>(children.size());
+            n.b = static_cast<std::uint32_t>(v.items.size());
+            children.resize(children.size() + v.items.size());
+            for (std::size_t i = 0; i < v.items.size(); i++) {
+                NodeId child = static_cast<NodeId>(nodes.size());
+                nodes.push_back(Node());
+                children[n.a + i] = child;
+                compile(v.items[i], child);
+            }
+            break;
+        }
+        case SharedValue::Map:
+            compileMap(v, n);
+            break;
+        default:
+            break;
+        }
+        nodes[id] = n;
+    }
+
+    void compileMap(const SharedValue& v, Node& n) {
+        std::uint32_t cap = 1;
+        while (cap < 2 * v.fields.size()) { cap <<= 1; }  // load <= 1/2
+        n.a = static_cast<std::uint32_t>(slots.size());
+        n.b = v.fields.empty() ? 0 : cap;
+        if (!n.b) return;
+        slots.resize(slots.size() + cap, Slot{0, 0, 0, 0});
+        for (auto& f : v.fields) {
+            const std::string& key = f.first;
+            std::uint32_t h = hash(key.data(), key.size());
+            std::uint32_t i = h & (cap - 1);
+            while (slots[n.a + i].value) {
+                const Slot& s = slots[n.a + i];
+                if (s.hash == h && s.keylen == key.size() &&
+                        pool.compare(s.keyoff, s.keylen, key) == 0) {
+                    break;  // duplicate key, overwritten below
+                }
+                i = (i + 1) & (cap - 1);
+            }
+            bool fresh = slots[n.a + i].value == 0;
+            NodeId child = static_cast<NodeId>(nodes.size());
+            nodes.push_back(Node());
+            std::uint32_t keyoff = fresh ? intern(key) : slots[n.a + i].keyoff;
+            slots[n.a + i] = Slot{keyoff,
+                                  static_cast<std::uint32_t>(key.size()),
+                                  h, child};
+            if (fresh) { n.c++; }
+            compile(f.second, child);
+        }
+    }
+};
+
+inline SharedValue SharedValue::fromLua(lua_State* st, int index, int depth) {
+    index = lua_absindex(st, index);
+    switch (lua_type(st, index)) {
+    case LUA_TNIL: return SharedValue();
+    case LUA_TBOOLEAN: return SharedValue(lua_toboolean(st, index) != 0);
+    case LUA_TNUMBER: return SharedValue(
+        static_cast<double>(lua_tonumber(st, index)));
+    case LUA_TSTRING: {
+        std::size_t n;
+        const char* s = lua_tolstring(st, index, &n);
+        return SharedValue(std::string(s, n));
+    }
+    case LUA_TTABLE:
+        break;
+    default:
+        throw RuntimeError(std::string("cannot share a ") +
+                           lua_typename(st, lua_type(st, index)));
+    }
+    if (depth > 200) { throw RuntimeError("tables nested too deeply"); }
+    luaL_checkstack(st, 3, "shared data");
+
+    std::size_t count = 0;
+    lua_pushnil(st);
+    while (lua_next(st, index)) { count++; lua_pop(st, 1); }
+    std::size_t len = lua_rawlen(st, index);
+
+    if (len && len == count) {
+        SharedValue v = array();
+        v.items.reserve(len);
+        for (std::size_t i = 1; i <= len; i++) {
+            lua_rawgeti(st, index, static_cast<int>(i));
+            v.items.push_back(fromLua(st, -1, depth + 1));
+            lua_pop(st, 1);
+        }
+        return v;
+    }
+    SharedValue v = map();
+    v.fields.reserve(count);
+    lua_pushnil(st);
+    while (lua_next(st, index)) {
+        if (lua_type(st, -2) != LUA_TSTRING) {
+            lua_pop(st, 2);
+            throw RuntimeError("shared maps need string keys");
+        }
+        std::size_t n;
+        const char* k = lua_tolstring(st, -2, &n);
+        v.fields.emplace_back(std::string(k, n), fromLua(st, -1, depth + 1));
+        lua_pop(st, 1);
+    }
+    return v;
+}
+
+namespace detail {
+    struct SharedLib {
+        struct Ref {
+            std::shared_ptr<const SharedData> data;
+            SharedData::NodeId id;
+        };
+
+        static constexpr const char* tname() { return "luamm.SharedData"; }
+
+        static Ref* check(lua_State* st, int index) {
+            return static_cast<Ref*>(luaL_checkudata(st, index, tname()));
+        }
+
+        static const void* cacheKey() {
+            static const char k = 0;
+            return &k;
+        }
+
+        /* userdata for nested maps and arrays are kept in a weak table, so
+         * repeated lookups of the same node do not allocate */
+        static void pushNode(lua_State* st,
+                             const std::shared_ptr<const SharedData>& data,
+                             SharedData::NodeId id) {
+            const SharedData::Node& n = data->node(id);
+            switch (n.type) {
+            case SharedValue::Nil: lua_pushnil(st); return;
+            case SharedValue::Boolean: lua_pushboolean(st, n.num != 0); return;
+            case SharedValue::Number: lua_pushnumber(st, n.num); return;
+            case SharedValue::String:
+                lua_pushlstring(st, data->string(n), n.b);
+                return;
+            default:
+                break;
+            }
+            cache(st);
+            lua_rawgetp(st, -1, &n);
+            if (!lua_isnil(st, -1)) {
+                lua_remove(st, -2);
+                return;
+            }
+            lua_pop(st, 1);
+            void* p = lua_newuserdata(st, sizeof(Ref));
+            new (p) Ref{data, id};
+            metatable(st);
+            lua_setmetatable(st, -2);
+            lua_pushvalue(st, -1);
+            lua_rawsetp(st, -3, &n);
+            lua_remove(st, -2);
+        }
+
+        static void cache(lua_State* st) {
+            lua_rawgetp(st, LUA_REGISTRYINDEX, cacheKey());
+            if (!lua_isnil(st, -1)) return;
+            lua_pop(st, 1);
+            lua_newtable(st);
+            lua_createtable(st, 0, 1);
+            lua_pushliteral(st, "v");
+            lua_setfield(st, -2, "__mode");
+            lua_setmetatable(st, -2);
+            lua_pushvalue(st, -1);
+            lua_rawsetp(st, LUA_REGISTRYINDEX, cacheKey());
+        }
+
+        static int gc(lua_State* st) {
+            check(st, 1)->~Ref();
+            return 0;
+        }
+
+        static int index(lua_State* st) {
+            Ref* r = check(st, 1);
+            const SharedData::Node& n = r->data->node(r->id);
+            if (n.type == SharedValue::Map) {
+                if (lua_type(st, 2) != LUA_TSTRING) { return 0; }
+                std::size_t len;
+                const char* key = lua_tolstring(st, 2, &len);
+                pushNode(st, r->data, r->data->find(n, key, len));
+                return 1;
+            }
+            if (lua_type(st, 2) != LUA_TNUMBER) { return 0; }
+            lua_Number k = lua_tonumber(st, 2);
+            if (!(k >= 1 && k <= n.b) || static_cast<std::uint32_t>(k) != k) {
+                return 0;
+            }
+            pushNode(st, r->data,
+                     r->data->item(n, static_cast<std::size_t>(k) - 1));
+            return 1;
+        }
+
+        static int newindex(lua_State* st) {
+            return luaL_error(st, "attempt to modify read-only shared data");
+        }
+
+        static int len(lua_State* st) {
+            Ref* r = check(st, 1);
+            const SharedData::Node& n = r->data->node(r->id);
+            lua_pushinteger(st, n.type == SharedValue::Map ? n.c : n.b);
+            return 1;
+        }
+
+        // iterator closure of pairs(), upvalue 1 holds the next position
+        static int iterate(lua_State* st) {
+            Ref* r = check(st, 1);
+            const SharedData::Node& n = r->data->node(r->id);
+            std::uint32_t pos = static_cast<std::uint32_t>(
+                lua_tointeger(st, lua_upvalueindex(1)));
+            if (n.type == SharedValue::Map) {
+                const char* key;
+                std::size_t len;
+                SharedData::NodeId value;
+                if (!r->data->next(n, pos, key, len, value)) { return 0; }
+                lua_pushinteger(st, pos);
+                lua_replace(st, lua_upvalueindex(1));
+                lua_pushlstring(st, key, len);
+                pushNode(st, r->data, value);
+                return 2;
+            }
+            if (pos >= n.b) { return 0; }
+            lua_pushinteger(st, pos + 1);
+            lua_replace(st, lua_upvalueindex(1));
+            lua_pushinteger(st, pos + 1);
+            pushNode(st, r->data, r->data->item(n, pos));
+            return 2;
+        }
+
+        static int pairs(lua_State* st) {
+            check(st, 1);
+            lua_pushinteger(st, 0);
+            lua_pushcclosure(st, iterate, 1);
+            lua_pushvalue(st, 1);
+            lua_pushnil(st);
+            return 3;
+        }
+
+        // maps have no array part, their iteration ends at once
+        static int ipairs(lua_State* st) {
+            Ref* r = check(st, 1);
+            const SharedData::Node& n = r->data->node(r->id);
+            lua_pushinteger(st, n.type == SharedValue::Map ? n.b : 0);
+            lua_pushcclosure(st, iterate, 1);
+            lua_pushvalue(st, 1);
+            lua_pushnil(st);
+            return 3;
+        }
+
+        static void metatable(lua_State* st) {
+            if (!luaL_newmetatable(st, tname())) { return; }
+            const luaL_Reg meta[] = {
+                {"__gc", gc}, {"__index", index}, {"__newindex", newindex},
+                {"__len", len}, {"__pairs", pairs}, {"__ipairs", ipairs},
+                {nullptr, nullptr}
+            };
+            luaL_setfuncs(st, meta, 0);
+            lua_pushboolean(st, 0);
+            lua_setfield(st, -2, "__metatable");
+        }
+    };
+}
+
+// pushes the root of data, a lua value or a read-only userdata
+inline void pushShared(lua_State* st, std::shared_ptr<const SharedData> data) {
+    detail::SharedLib::pushNode(st, data, data->root());
+}
+
+} // end namespace
+
+#endif
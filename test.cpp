@@ -28,6 +28,14 @@
 
 #define BOOST_TEST_MODULE LuammTest
 #include "luamm.hpp"
+#include "luamm/profiler.hpp"
+#include "luamm/serialize.hpp"
+#include "luamm/buffer.hpp"
+#include "luamm/numarray.hpp"
+#include "luamm/shared.hpp"
+#include "luamm/json.hpp"
+#include "luamm/msgpack.hpp"
+#include "luamm/sandbox.hpp"
 #include <boost/test/unit_test.hpp>
 #include <boost/mpl/assert.hpp>
 #include <cstdlib>
@@ -499,3 +507,1389 @@ BOOST_AUTO_TEST_CASE( long_arglist )
         BOOST_CHECK_EQUAL(e, 5);
     }
 }
+
+BOOST_AUTO_TEST_CASE( optional_trailing_arguments )
+{
+    TestLuaState lua;
+    {
+        Closure cl = lua.newCallable([](Number a, Optional<Number> b) {
+            return a + b.value_or(100);
+        });
+        BOOST_CHECK_EQUAL(Number(cl(1)), 101);
+        BOOST_CHECK_EQUAL(Number(cl(1, 2)), 3);
+        BOOST_CHECK_EQUAL(Number(cl(1, Nil())), 101);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( bad_argument_reports_position_and_types )
+{
+    TestLuaState lua;
+    {
+        auto scope = lua.newScope();
+        Closure cl = lua.newCallable([](Number a, string&& s) {
+            return a;
+        });
+        try {
+            Number n = cl(1, 2);
+            BOOST_ERROR("call should fail, got " << n);
+        } catch (RuntimeError& e) {
+            BOOST_CHECK_EQUAL(e.what(),
+                              string("bad argument#2 (string expected, got number)"));
+        }
+        BOOST_CHECK_THROW(cl().call(0), RuntimeError);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( arity_beyond_former_preprocessor_limit )
+{
+    TestLuaState lua;
+    {
+        auto scope = lua.newScope();
+        Closure cl = lua.newCallable([](int a, int b, int c, int d, int e,
+                                        int f, int g, int h, int i, int j,
+                                        int k, int l, int m, int n, int o,
+                                        int p, int q) {
+            return a+b+c+d+e+f+g+h+i+j+k+l+m+n+o+p+q;
+        });
+        BOOST_CHECK_EQUAL(Number(cl(1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17)),
+                          153);
+
+        Closure ret = lua.newFunc(
+            "return 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17");
+        int a, b, q;
+        luamm::tie(a, b, ignore, ignore, ignore, ignore, ignore, ignore,
+                   ignore, ignore, ignore, ignore, ignore, ignore, ignore,
+                   ignore, q) = ret();
+        BOOST_CHECK_EQUAL(a + b + q, 20);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( overloaded_callable )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        lua["f"] = lua.newOverload(
+            [](Number a) { return a * 2; },
+            [](Number a, Number b) { return a + b; },
+            [](string&& s) { return s + "!"; },
+            [](Table&& t, Optional<Number> n) -> Number {
+                return t.length() + n.value_or(0);
+            }
+        );
+        lua.newFunc(R"==(
+            assert(f(21) == 42)
+            assert(f(1, 2) == 3)
+            assert(f("hi") == "hi!")
+            assert(f({1, 2, 3}) == 3)
+            assert(f({1, 2, 3}, 10) == 13)
+            assert(not pcall(f, true))
+            -- the message names every argument, more than the stack slack
+            local args = {}
+            for i = 1, 200 do args[i] = {} end
+            local ok, msg = pcall(f, table.unpack(args))
+            assert(not ok and msg:find("(table, table", 1, true))
+        )==")();
+    }
+}
+
+BOOST_AUTO_TEST_CASE( overloads_on_bound_classes )
+{
+    struct Vec { double v = 1; };
+    struct Mat { double m = 2; };
+    TestLuaState lua;
+    lua["_G"] = lua.open(luaopen_base);
+    {
+        auto scope = lua.newScope();
+        lua["Vec"] = Table(std::move(lua.class_<Vec>("Vec").init()));
+        lua["Mat"] = Table(std::move(lua.class_<Mat>("Mat").init()));
+        lua["f"] = lua.newOverload(
+            [](Vec& v) { return "vec " + std::to_string((int)v.v); },
+            [](Mat& m) { return "mat " + std::to_string((int)m.m); }
+        );
+        lua.newFunc(R"==(
+            assert(f(Vec()) == "vec 1")
+            assert(f(Mat()) == "mat 2")
+            assert(not pcall(f, 1))
+        )==")();
+    }
+}
+
+BOOST_AUTO_TEST_CASE( overloaded_class_method )
+{
+    TestLuaState lua;
+    lua["_G"] = lua.open(luaopen_base);
+    {
+        auto scope = lua.newScope();
+        struct Acc {
+            Number sum;
+            Acc() : sum(0) {}
+            void add(Number n) { sum += n; }
+            void add2(Number a, Number b) { sum += a * b; }
+            Number get() { return sum; }
+        };
+        lua["acc"] = Table(std::move(
+            lua.class_<Acc>("acc")
+            .def("add", &Acc::add)
+            .def("add", &Acc::add2)
+            .def("get", &Acc::get)
+            .init()
+        ));
+        lua.newFunc(R"==(
+            local a = acc()
+            a:add(1)
+            a:add(2, 3)
+            assert(a:get() == 7)
+        )==")();
+    }
+}
+
+BOOST_AUTO_TEST_CASE( borrowed_object_and_validated_self )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        struct Big {
+            int data[256];
+            int get(int i) { return data[i]; }
+            void set(int i, int v) { data[i] = v; }
+        };
+        struct Other { int x; };
+        lua["big"] = Table(std::move(
+            lua.class_<Big>("big")
+            .def("get", &Big::get)
+            .def("set", &Big::set)
+            .def("sum", [](const Big& a, Big* b) {
+                return a.data[0] + b->data[0];
+            })
+        ));
+        lua["other"] = Table(std::move(lua.class_<Other>("other").init()));
+
+        Big owned;
+        owned.data[0] = 1;
+        lua["b"] = borrow(owned);
+        lua.newFunc(R"==(
+            b:set(0, b:get(0) + 41)
+            assert(b.sum(b, b) == 84)
+            local ok, err = pcall(b.get, other(), 0)
+            assert(not ok and err:find("big expected"), err)
+        )==")().call(0);
+        BOOST_CHECK_EQUAL(owned.data[0], 42);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( bound_objects_are_destroyed_by_gc )
+{
+    static int alive = 0;
+    struct Res {
+        Res() { alive++; }
+        Res(const Res&) { alive++; }
+        ~Res() { alive--; }
+        int id() { return 7; }
+    };
+    {
+        TestLuaState lua;
+        lua.openlibs();
+        auto scope = lua.newScope();
+        lua["res"] = Table(std::move(
+            lua.class_<Res>("res")
+            .def("id", &Res::id)
+            .def("keep", [](std::shared_ptr<Res> p) { return p.use_count(); })
+            .init()
+        ));
+
+        auto shared = std::make_shared<Res>();
+        lua["shared"] = shared;
+        lua["unique"] = std::unique_ptr<Res>(new Res());
+        Res local;
+        lua["borrowed"] = borrow(local);
+        BOOST_CHECK_EQUAL(alive, 3);
+        // an lvalue is only given up by an explicit move
+        std::unique_ptr<Res> owned(new Res());
+        lua["moved"] = std::move(owned);
+        BOOST_CHECK(!owned);
+        lua["make"] = lua.newCallable([]() {
+            return std::unique_ptr<Res>(new Res());
+        });
+        Number n = lua.newFunc(R"==(
+            local tmp = res()
+            assert(shared:id() + unique:id() + borrowed:id() + tmp:id() == 28)
+            assert(moved:id() + make():id() == 14)
+            assert(not pcall(res.keep, borrowed))
+            return shared:keep()
+        )==")();
+        BOOST_CHECK_EQUAL(n, 3);
+
+        lua.newFunc("shared, unique, borrowed, moved = nil; collectgarbage()")();
+        BOOST_CHECK_EQUAL(shared.use_count(), 1);
+        BOOST_CHECK_EQUAL(alive, 2);
+    }
+    BOOST_CHECK_EQUAL(alive, 0);
+}
+
+BOOST_AUTO_TEST_CASE( gc_control )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    GC gc = lua.gc();
+    {
+        auto pause = gc.pause();
+        BOOST_CHECK(!gc.running());
+        std::size_t before = gc.count();
+        lua.newFunc("garbage = {} for i = 1, 1000 do garbage[i] = {} end")();
+        BOOST_CHECK_GT(gc.count(), before);
+        lua.newFunc("garbage = nil")();
+
+        // stepping works while the collector is stopped
+        GCScheduler idle(lua.ptr(), std::chrono::microseconds(100000));
+        std::size_t grown = gc.count();
+        while (!idle.idle()) {}
+        BOOST_CHECK_LT(gc.count(), grown);
+    }
+    BOOST_CHECK(gc.running());
+    {
+        // nested pauses, and one taken while stopped, restart nothing
+        auto outer = gc.pause();
+        {
+            auto inner = gc.pause();
+        }
+        BOOST_CHECK(!gc.running());
+    }
+    BOOST_CHECK(gc.running());
+    gc.stop();
+    {
+        auto pause = gc.pause();
+    }
+    BOOST_CHECK(!gc.running());
+    gc.restart();
+    int pause = gc.setpause(150);
+    BOOST_CHECK_EQUAL(gc.setpause(pause), 150);
+}
+
+BOOST_AUTO_TEST_CASE( sampling_profiler )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        Profiler prof(lua.ptr(), std::chrono::microseconds(0), 100);
+        prof.start();
+        lua.newFunc(R"==(
+            local function inner(n)
+                local s = 0
+                for i = 1, n do s = s + i % 7 end
+                return s
+            end
+            function outer()
+                local s = 0
+                for i = 1, 200 do s = s + inner(500) end
+                return s
+            end
+            outer()
+        )==")();
+        prof.stop();
+
+        BOOST_CHECK_GT(prof.samples(), 0u);
+        auto funcs = prof.functions();
+        BOOST_REQUIRE(!funcs.empty());
+        BOOST_CHECK(funcs[0].name.find("inner") == 0);
+        string folded = prof.folded();
+        BOOST_CHECK(folded.find("outer (") != string::npos);
+        BOOST_CHECK(folded.find(";inner (") != string::npos);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( profiler_with_budget )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    auto spin = lua.newFunc("while true do end");
+    {
+        // the profiler forwards the count events of the budget
+        Budget budget(lua.ptr(), 200000);
+        Profiler prof(lua.ptr(), std::chrono::microseconds(0), 100);
+        prof.start();
+        BOOST_CHECK_THROW(spin.call().call(0), BudgetExceeded);
+        prof.stop();
+        BOOST_CHECK(budget.exceeded());
+        BOOST_CHECK_GT(prof.samples(), 0u);
+        BOOST_CHECK(lua_gethook(lua.ptr()) != nullptr);
+    }
+    BOOST_CHECK(lua_gethook(lua.ptr()) == nullptr);
+    {
+        // and keeps sampling under a budget started after it
+        Profiler prof(lua.ptr(), std::chrono::microseconds(0), 100);
+        prof.start();
+        {
+            Budget budget(lua.ptr(), 200000);
+            BOOST_CHECK_THROW(spin.call().call(0), BudgetExceeded);
+        }
+        std::size_t samples = prof.samples();
+        BOOST_CHECK_GT(samples, 0u);
+        lua.newFunc("for i = 1, 100000 do end")();
+        BOOST_CHECK_GT(prof.samples(), samples);
+        prof.stop();
+    }
+    BOOST_CHECK(lua_gethook(lua.ptr()) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE( serialize_between_states )
+{
+    struct Point {
+        double x, y;
+        Point(double x, double y) : x(x), y(y) {}
+    };
+    TestLuaState from, to;
+    for (State* st : {(State*)&from, (State*)&to}) {
+        auto scope = st->newScope();
+        (*st)["Point"] = Table(std::move(st->class_<Point>("Point")
+            .init<double, double>()
+            .attribute("x", &Point::x)));
+    }
+    Serializer ser;
+    ser.addClass<Point>(
+        [](const Point& p, std::string& out) {
+            out.append(reinterpret_cast<const char*>(&p.x), 2 * sizeof(double));
+        },
+        [](const char* data, std::size_t len) {
+            double xy[2];
+            if (len != sizeof xy) throw RuntimeError("bad point");
+            memcpy(xy, data, sizeof xy);
+            return Point(xy[0], xy[1]);
+        });
+
+    from.newFunc(R"==(
+        local shared = {1, 2, 3}
+        ctx = {name = "req", id = 42, ratio = 0.25, neg = -7, ok = true,
+               list = shared, again = shared, p = Point(1.5, 2),
+               [10] = "ten", [2.5] = "frac", "a", "b"}
+        ctx.self = ctx
+    )==")();
+
+    string buf;
+    {
+        auto scope = from.newScope();
+        lua_getglobal(from.ptr(), "ctx");
+        ser.dump(from.ptr(), -1, buf);
+    }
+    ser.load(to.ptr(), buf);
+    lua_setglobal(to.ptr(), "ctx");
+    bool ok = to.newFunc(R"==(
+        return ctx.name == "req" and ctx.id == 42 and ctx.ratio == 0.25
+           and ctx.neg == -7 and ctx.ok == true and ctx[1] == "a"
+           and ctx[2] == "b" and ctx[10] == "ten" and ctx[2.5] == "frac"
+           and ctx.list == ctx.again and #ctx.list == 3 and ctx.list[3] == 3
+           and ctx.self == ctx and ctx.p.x == 1.5
+    )==")();
+    BOOST_CHECK(ok);
+
+    // truncated input leaves the stack untouched
+    for (std::size_t n = 0; n < buf.size(); n++) {
+        BOOST_CHECK_THROW(ser.load(to.ptr(), buf.data(), n), RuntimeError);
+    }
+    BOOST_CHECK_EQUAL(to.top(), 0);
+    {
+        auto scope = from.newScope();
+        auto func = from.newFunc("return 1");
+        BOOST_CHECK_THROW(ser.dump(from.ptr(), -1), RuntimeError);
+    }
+    to["ctx"] = Nil();
+}
+
+BOOST_AUTO_TEST_CASE( buffer_userdata )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    Buffer::open(lua.ptr());
+    lua_setglobal(lua.ptr(), "buffer");
+
+    static char frame[] = "\x00\x05hello\x01\x02\x03\x04|tail";
+    int released = 0;
+    lua["frame"] = Buffer::wrap(frame, sizeof frame - 1,
+        [&released](char* p, std::size_t n) {
+            BOOST_CHECK(p == frame);
+            released++;
+        });
+    lua["size"] = lua.newCallable([](Buffer b) { return (Number)b.size(); });
+
+    bool ok = lua.newFunc(R"==(
+        local len = frame:getu16(1, true)
+        local body = frame:sub(3, 2 + len)
+        assert(#body == 5 and body:tostring() == "hello")
+        assert(size(body) == 5)
+        assert(frame:getu32(8, true) == 0x01020304)
+        assert(frame:getu32(8) == 0x04030201)
+        local s, e = frame:find("|")
+        assert(s == 12 and e == 12 and frame:sub(s + 1):tostring() == "tail")
+        assert(frame:find("tail") == 13 and frame:find("nope") == nil)
+        -- slices share memory with the parent
+        body:setu8(1, string.byte("j"))
+        assert(frame:sub(3, 7):tostring() == "jello")
+        assert(not pcall(frame.getu32, frame, 14))
+
+        local b = buffer.new(8)
+        b:setf64(1, 0.5)
+        b:append("ab"):append(body)
+        assert(#b == 15 and b:getf64(1) == 0.5 and b:sub(-5):tostring() == "jello")
+        b:seti16(1, -2)
+        assert(b:geti16(1) == -2 and b:getu16(1) == 65534)
+        -- the source is the buffer itself, or a slice of it
+        local c = buffer.fromstring("abcdefgh")
+        c:append(c)
+        assert(c:tostring() == "abcdefghabcdefgh")
+        c:append(c:sub(3, 4))
+        assert(c:tostring() == "abcdefghabcdefghcd")
+        frame, body = nil, nil
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+    BOOST_CHECK_EQUAL(frame[2], 'j');
+    lua.gc().collect();
+    BOOST_CHECK_EQUAL(released, 1);
+}
+
+BOOST_AUTO_TEST_CASE( numeric_arrays )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    openNumArray(lua.ptr());
+    lua_setglobal(lua.ptr(), "num");
+
+    std::vector<double> features = {3, -1, 4, 1, 5, 9, 2, 6};
+    lua["features"] = Float64Array::wrap(features.data(), features.size());
+    lua["weights"] = Float64Array(std::vector<double>(features.size(), 0.5));
+    lua["total"] = lua.newCallable([](Float64Array a) {
+        return numeric::sum(a.data(), a.size());
+    });
+
+    bool ok = lua.newFunc(R"==(
+        assert(#features == 8 and features[3] == 4 and features[9] == nil)
+        assert(features:sum() == 29 and total(features) == 29)
+        assert(features:min() == -1 and features:max() == 9)
+        assert(features:dot(weights) == 14.5)
+        local mask = features:gt(3)
+        assert(mask:sum() == 4 and mask[1] == 0 and mask[3] == 1)
+        local picked = features:gather({6, 1, 6})
+        assert(#picked == 3 and picked[1] == 9 and picked[2] == 3)
+        local ints = num.int32({2, 4})
+        assert(features:gather(ints):sum() == 0)
+        assert(not pcall(features.gather, features, {0}))
+        assert(not pcall(features.dot, features, num.float64(3)))
+        weights:add(features):scale(2)
+        assert(weights[1] == 7)
+        features[1] = 10
+        local f = num.float32({0.5, 0.25})
+        f:add(f)
+        assert(f:sum() == 1.5)
+        local i = num.int64(3)
+        assert(i:sum() == 0 and #i == 3)
+        features:sort()
+        assert(not pcall(features.gather, features, {1.5}))
+        assert(not pcall(num.int32, {2^31}) and num.int32({-2^31})[1] == -2^31)
+        assert(not pcall(num.int64, {0/0}))
+        assert(not pcall(i.add, i, 2^63) and not pcall(ints.lt, ints, 0/0))
+        local big = num.int32({2e9, 2e9})
+        assert(big:sum() == 4e9 and big:dot(big) == 8e18)
+        assert(not pcall(big.scale, big, 2) and not pcall(big.add, big, big))
+        assert(not pcall(big.add, big, 2^30) and big[1] == 2e9)
+        assert(big:add(-2e9):scale(-3)[2] == 0)
+        local nan = num.float64({3, 0/0, 1, 0/0, 2}):sort()
+        assert(nan[1] == 1 and nan[3] == 3 and nan[4] ~= nan[4])
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+    // wrapped memory is shared, not copied
+    BOOST_CHECK_EQUAL(features[0], -1);
+    BOOST_CHECK_EQUAL(features[7], 10);
+
+    float v[] = {1, 2, 3, 4, 5};
+    BOOST_CHECK_EQUAL(numeric::dot(v, v, 5), 55);
+}
+
+BOOST_AUTO_TEST_CASE( shared_read_only_data )
+{
+    std::shared_ptr<const SharedData> data;
+    {
+        TestLuaState loader;
+        auto scope = loader.newScope();
+        loader.newFunc(R"==(
+            geo = {cities = {"paris", "tokyo", "lima"},
+                   codes = {fr = 33, jp = 81}, enabled = true}
+        )==")();
+        lua_getglobal(loader.ptr(), "geo");
+        SharedValue tree = SharedValue::fromLua(loader.ptr(), -1);
+        tree.set("version", 2).set("limits", SharedValue::array({1, 2.5}));
+        data = std::make_shared<const SharedData>(tree);
+        loader["geo"] = Nil();
+    }
+    BOOST_CHECK_GT(data->memory(), 0u);
+
+    for (int i = 0; i < 2; i++) {
+        TestLuaState lua;
+        lua.openlibs();
+        pushShared(lua.ptr(), data);
+        lua_setglobal(lua.ptr(), "geo");
+        bool ok = lua.newFunc(R"==(
+            assert(geo.cities[2] == "tokyo" and #geo.cities == 3)
+            assert(geo.codes.jp == 81 and geo.codes.xx == nil)
+            assert(geo.enabled == true and geo.version == 2)
+            assert(geo.limits[2] == 2.5 and #geo == 5)
+            assert(geo.codes == geo.codes)
+            local n = 0
+            for k, v in pairs(geo.codes) do n = n + v end
+            assert(n == 114)
+            local seen = {}
+            for i, v in ipairs(geo.cities) do seen[i] = v end
+            assert(#seen == 3 and seen[3] == "lima")
+            assert(not pcall(function() geo.codes.de = 49 end))
+            return true
+        )==")();
+        BOOST_CHECK(ok);
+    }
+    BOOST_CHECK_EQUAL(data.use_count(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( json_codec )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    Json::open(lua.ptr());
+    lua_setglobal(lua.ptr(), "json");
+
+    bool ok = lua.newFunc(R"==(
+        local doc = json.decode(
+            ' {"name": "caf\\u00e9 \\"x\\"", "ids": [1, -2, 3.5e2, 0.1], ' ..
+            '"empty": {}, "none": null, "ok": true, "long": ' ..
+            '"abcdefghijklmnopqrstuvwxyz0123456789\\ud83d\\ude00"} ')
+        assert(doc.name == 'caf\195\169 "x"')
+        assert(#doc.ids == 4 and doc.ids[2] == -2 and doc.ids[3] == 350)
+        assert(doc.ids[4] == 0.1 and doc.none == json.null and doc.ok)
+        assert(doc.long:sub(-4) == "\240\159\152\128")
+        assert(next(doc.empty) == nil)
+
+        local big = {}
+        for i = 1, 100 do big[i] = {id = i, tag = "t" .. i} end
+        local text = json.encode(big)
+        local back = json.decode(text)
+        assert(#back == 100 and back[77].tag == "t77" and back[100].id == 100)
+
+        assert(json.encode({1, "a\n", false}) == '[1,"a\\n",false]')
+        assert(json.encode({x = 0.5}) == '{"x":0.5}')
+        assert(json.encode({}) == '{}')
+        assert(json.decode('{"a":1,"a":2}').a == 2)
+        for _, bad in ipairs{'[1,', '{"a" 1}', '01', '"\\x"', 'nul', '[1]x'} do
+            assert(not pcall(json.decode, bad), bad)
+        end
+        assert(not pcall(json.encode, {f = print}))
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+
+    CodecOptions opts;
+    opts.emptyAsArray = true;
+    opts.nullAsNil = true;
+    Json json(opts);
+    lua_newtable(lua.ptr());
+    BOOST_CHECK_EQUAL(json.encode(lua.ptr(), -1), "[]");
+    lua_pop(lua.ptr(), 1);
+    json.decode(lua.ptr(), "null");
+    BOOST_CHECK(lua_isnil(lua.ptr(), -1));
+    lua_pop(lua.ptr(), 1);
+    BOOST_CHECK_THROW(json.decode(lua.ptr(), "[1, 2"), RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( msgpack_codec )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    MsgPack::open(lua.ptr());
+    lua_setglobal(lua.ptr(), "msgpack");
+
+    bool ok = lua.newFunc(R"==(
+        local v = {small = 5, neg = -100, big = 2^40, nbig = -2^40,
+                   pi = 3.25, s = string.rep("x", 300), list = {1, 2, {3}},
+                   flag = false, [7] = "seven"}
+        local back = msgpack.decode(msgpack.encode(v))
+        for k, x in pairs(v) do
+            if type(x) ~= "table" then assert(back[k] == x, k) end
+        end
+        assert(back.list[3][1] == 3 and #back.list == 3)
+        assert(msgpack.encode(5) == "\5" and msgpack.encode(-1) == "\255")
+        assert(msgpack.encode({1, 2}) == "\146\1\2")
+        assert(msgpack.decode("\192") == msgpack.null)
+        assert(not pcall(msgpack.decode, "\146\1"))
+        assert(not pcall(msgpack.decode, "\199"))
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+BOOST_AUTO_TEST_CASE( interned_keys )
+{
+    TestLuaState lua;
+    Key name = lua.key("name");
+    BOOST_CHECK_EQUAL(lua.key("name").id(), name.id());
+    BOOST_CHECK(lua.key("other").id() != name.id());
+
+    lua[name] = "global";
+    string global = lua["name"];
+    BOOST_CHECK_EQUAL(global, "global");
+    BOOST_CHECK(lua[name].isstr());
+    {
+        Table t = lua.newTable();
+        for (int i = 0; i < 3; i++) {
+            t[name] = i;
+        }
+        int v = t[name];
+        BOOST_CHECK_EQUAL(v, 2);
+        int w = t["name"];
+        BOOST_CHECK_EQUAL(w, 2);
+    }
+    string back = lua[name];
+    BOOST_CHECK_EQUAL(back, "global");
+    lua[name] = Nil();
+    BOOST_CHECK(lua["name"].isnil());
+}
+
+BOOST_AUTO_TEST_CASE( batched_calls )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    lua.newFunc(R"==(
+        function score(a, b)
+            if a < 0 then error("negative input") end
+            return a * b + 1
+        end
+        function tostr(x) return 'n' .. x end
+    )==")();
+    Closure fn = lua["score"];
+
+    std::vector<std::tuple<double, double>> records;
+    for (int i = 0; i < 1000; i++) { records.emplace_back(i, 2); }
+    std::vector<Number> results;
+    fn.map<Number>(records.begin(), records.end(), std::back_inserter(results));
+    BOOST_REQUIRE_EQUAL(results.size(), 1000u);
+    BOOST_CHECK_EQUAL(results[0], 1);
+    BOOST_CHECK_EQUAL(results[999], 1999);
+
+    std::vector<double> a = {1, 2, 3}, b = {10, 20, 30};
+    std::vector<Number> cols(3);
+    fn.mapColumns<Number>(3, cols.begin(), a.data(), b.data());
+    BOOST_CHECK_EQUAL(cols[2], 91);
+
+    Closure f2 = lua["tostr"];
+    std::vector<int> ints = {4, 5};
+    std::vector<string> strs;
+    f2.map<string>(ints.begin(), ints.end(), std::back_inserter(strs));
+    BOOST_CHECK_EQUAL(strs[1], "n5");
+
+    records[500] = std::make_tuple(-1.0, 0.0);
+    try {
+        results.clear();
+        fn.map<Number>(records.begin(), records.end(), std::back_inserter(results));
+        BOOST_FAIL("error not raised");
+    } catch (RuntimeError& e) {
+        BOOST_CHECK(string(e.what()).find("batch item 500") == 0);
+        BOOST_CHECK(string(e.what()).find("negative input") != string::npos);
+    }
+    BOOST_CHECK_EQUAL(results.size(), 500u);
+}
+
+BOOST_AUTO_TEST_CASE( stack_reserve_and_bulk_push )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        std::vector<Number> values(500);
+        for (int i = 0; i < 500; i++) { values[i] = i; }
+        lua_getglobal(lua.ptr(), "select");
+        lua.push("#");
+        int n = lua.pushRange(values.begin(), values.end());
+        BOOST_CHECK_EQUAL(n, 500);
+        lua_call(lua.ptr(), n + 1, 1);
+        int count = lua[-1];
+        BOOST_CHECK_EQUAL(count, 500);
+
+        BOOST_CHECK_EQUAL(lua.pushAll(1.5, "two", true), 3);
+        string two = lua[-2];
+        BOOST_CHECK_EQUAL(two, "two");
+        BOOST_CHECK_THROW(lua.reserve(100000000), RuntimeError);
+    }
+
+    // more return values than the LUA_MINSTACK slots of a c function
+    lua["many"] = lua.newCallable([]() {
+        auto five = std::make_tuple(1.0, 2.0, 3.0, 4.0, 5.0);
+        return std::tuple_cat(five, five, five, five, five);
+    });
+    bool ok = lua.newFunc(R"==(
+        local r = {many()}
+        return #r == 25 and r[25] == 5 and r[21] == 1
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+BOOST_AUTO_TEST_CASE( variadic_arguments_and_results )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    lua["join"] = lua.newCallable([](const string& sep, VarArgs rest) {
+        string out;
+        for (auto arg : rest) {
+            if (!out.empty()) { out += sep; }
+            out += arg.is<Number>() ? std::to_string(arg.to<int>())
+                                    : arg.to<string>();
+        }
+        return out;
+    });
+    lua["count"] = lua.newCallable([](VarArgs rest) {
+        return rest.size();
+    });
+    lua["range"] = lua.newCallable([](State& st, int n) {
+        MultiResult r(st);
+        for (int i = 1; i <= n; i++) { r.push(i); }
+        return r;
+    });
+    lua["echo"] = lua.newCallable([](State& st, VarArgs rest) {
+        MultiResult r(st);
+        for (int i = rest.size() - 1; i >= 0; i--) {
+            lua_pushvalue(st.ptr(), rest[i].index());
+        }
+        return r;
+    });
+
+    bool ok = lua.newFunc(R"==(
+        assert(join("-", "a", 1, "b") == "a-1-b")
+        assert(join(",") == "")
+        assert(count() == 0 and count(nil, nil, 3) == 3)
+        assert(select("#", range(0)) == 0)
+        local r = {range(30)}
+        assert(#r == 30 and r[30] == 30)
+        local a, b, c = echo(1, "x", true)
+        assert(a == true and b == "x" and c == 1)
+        local ok, err = pcall(join, "-", {})
+        assert(not ok and err:find("bad argument#2", 1, true), err)
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+
+    // variadic overloads are tried after the fixed ones
+    lua["f"] = lua.newOverload(
+        [](Number) { return string("number"); },
+        [](const string&, VarArgs rest) {
+            return "string+" + std::to_string(rest.size());
+        });
+    string s = lua.newFunc("return f(1) .. ' ' .. f('a', 2, 3)")();
+    BOOST_CHECK_EQUAL(s, "number string+2");
+}
+
+BOOST_AUTO_TEST_CASE( attribute_and_method_lookup )
+{
+    struct Counter {
+        int value;
+        std::string label;
+        Counter(int v) : value(v), label("c") {}
+        int next() { return ++value; }
+        int twice() const { return 2 * value; }
+    };
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        lua["Counter"] = Table(std::move(lua.class_<Counter>("Counter")
+            .init<int>()
+            .def("next", &Counter::next)
+            .def("get_double", &Counter::twice)
+            .attribute("value", &Counter::value)
+            .attribute("label", &Counter::label, Class_<Counter>::Read)));
+    }
+    bool ok = lua.newFunc(R"==(
+        local c = Counter(1)
+        assert(c:next() == 2 and c.value == 2)
+        c.value = 10
+        assert(c.value == 10 and c:get_value() == 10)
+        -- accessors defined as methods are properties too
+        assert(c.double == 20)
+        assert(c.label == "c" and c.missing == nil)
+        -- read only: the assignment is ignored
+        c.label = "d"
+        assert(c.label == "c")
+        local ok = pcall(function() c.value = "ten" end)
+        assert(not ok and c.value == 10)
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+BOOST_AUTO_TEST_CASE( class_inheritance )
+{
+    struct Named {
+        std::string name;
+        Named() : name("shape") {}
+        virtual ~Named() {}
+        std::string getName() const { return name; }
+    };
+    struct Shape {
+        double scale = 1;
+        virtual ~Shape() {}
+        virtual double area() const { return 0; }
+        double scaled() const { return scale * area(); }
+    };
+    struct Square : Named, Shape {
+        double side;
+        Square(double side) : side(side) {}
+        double area() const override { return side * side; }
+    };
+    struct Tile : Square {
+        Tile() : Square(2) {}
+        std::string kind() const { return "tile"; }
+    };
+
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        lua["Named"] = Table(std::move(lua.class_<Named>("Named")
+            .def("getName", &Named::getName)));
+        lua["Shape"] = Table(std::move(lua.class_<Shape>("Shape")
+            .def("area", &Shape::area)
+            .def("scaled", &Shape::scaled)
+            .attribute("scale", &Shape::scale)));
+        lua["Square"] = Table(std::move(lua.class_<Square, Named, Shape>("Square")
+            .init<double>()
+            .attribute("side", &Square::side)));
+        lua["Tile"] = Table(std::move(lua.class_<Tile, Square>("Tile")
+            .init<>()
+            .def("kind", &Tile::kind)));
+    }
+    lua["areaOf"] = lua.newCallable([](const Shape& s) { return s.area(); });
+
+    bool ok = lua.newFunc(R"==(
+        local sq = Square(3)
+        assert(sq:area() == 9 and sq:getName() == "shape")
+        sq.scale = 2
+        assert(sq.scale == 2 and sq:scaled() == 18 and sq.side == 3)
+        assert(areaOf(sq) == 9)
+        local t = Tile()
+        assert(t:kind() == "tile" and t:area() == 4 and t:getName() == "shape")
+        assert(areaOf(t) == 4 and t.scale == 1)
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+
+    // the userdata holds a Square, reading it as a Shape adjusts the pointer
+    auto scope = lua.newScope();
+    lua.newFunc("sq = Square(5)")();
+    lua_getglobal(lua.ptr(), "sq");
+    UserData ud(lua.ptr(), -1);
+    Shape& shape = ud.to<Shape>();
+    BOOST_CHECK_EQUAL(shape.area(), 25);
+    BOOST_CHECK_EQUAL(ud.to<Named>().getName(), "shape");
+}
+
+struct Vec2 {
+    double x, y;
+    Vec2(double x, double y) : x(x), y(y) {}
+    Vec2 operator+(const Vec2& o) const { return Vec2(x + o.x, y + o.y); }
+    Vec2 operator-(const Vec2& o) const { return Vec2(x - o.x, y - o.y); }
+    Vec2 operator*(double k) const { return Vec2(x * k, y * k); }
+    Vec2 operator-() const { return Vec2(-x, -y); }
+    bool operator==(const Vec2& o) const { return x == o.x && y == o.y; }
+    bool operator<(const Vec2& o) const { return x * x + y * y < o.x * o.x + o.y * o.y; }
+    bool operator<=(const Vec2& o) const { return !(o < *this); }
+    double operator()(double k) const { return k * (x + y); }
+    int size() const { return 2; }
+};
+
+std::ostream& operator<<(std::ostream& os, const Vec2& v)
+{
+    return os << "(" << v.x << ", " << v.y << ")";
+}
+
+BOOST_AUTO_TEST_CASE( operator_metamethods )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        lua["Vec2"] = Table(std::move(lua.class_<Vec2>("Vec2")
+            .init<double, double>()
+            .attribute("x", &Vec2::x)
+            .operators<op::add, op::sub, op::mul, op::unm, op::eq, op::lt,
+                       op::le, op::len, op::tostring, op::concat, op::call>()));
+    }
+    bool ok = lua.newFunc(R"==(
+        local a, b = Vec2(1, 2), Vec2(3, 4)
+        local c = a + b
+        assert(c.x == 4 and tostring(c) == "(4, 6)")
+        assert(tostring(b - a) == "(2, 2)" and tostring(-a) == "(-1, -2)")
+        assert(tostring(a * 3) == "(3, 6)")
+        assert(a + b == Vec2(4, 6) and a ~= b)
+        assert(a < b and a <= Vec2(2, 1) and not (b < a))
+        assert(#a == 2 and a(10) == 30)
+        assert("v=" .. a == "v=(1, 2)" and a .. "!" == "(1, 2)!")
+        local ok, err = pcall(function() return 3 * a end)
+        assert(not ok and err:find("bad operands for __mul", 1, true))
+        ok = pcall(function() return a + 1 end)
+        assert(not ok)
+        return true
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+struct alignas(64) WideLanes {
+    static int live;
+    double lanes[8];
+    explicit WideLanes(double v) { for (double& l : lanes) { l = v; } live++; }
+    WideLanes(const WideLanes& o) { *this = o; live++; }
+    WideLanes& operator=(const WideLanes& o) {
+        std::copy(o.lanes, o.lanes + 8, lanes);
+        return *this;
+    }
+    ~WideLanes() { live--; }
+    double sum() const {
+        double s = 0;
+        for (double l : lanes) { s += l; }
+        return s;
+    }
+};
+int WideLanes::live = 0;
+
+BOOST_AUTO_TEST_CASE( aligned_userdata_in_place )
+{
+    auto aligned = [](const void* p) {
+        return reinterpret_cast<std::uintptr_t>(p) % alignof(WideLanes) == 0;
+    };
+    {
+        TestLuaState lua;
+        lua.openlibs();
+        {
+            auto scope = lua.newScope();
+            UserData ud = lua.newUserData<WideLanes>(1.5);
+            WideLanes& w = ud.to<WideLanes>();
+            BOOST_CHECK(aligned(&w));
+            BOOST_CHECK_EQUAL(w.sum(), 12);
+            BOOST_CHECK(ud.hasmetatable());
+        }
+        {
+            auto scope = lua.newScope();
+            lua["Wide"] = Table(std::move(lua.class_<WideLanes>("Wide")
+                .init<double>()
+                .def("sum", &WideLanes::sum)));
+        }
+        lua["check"] = lua.newCallable([&](const WideLanes& w) {
+            return aligned(&w);
+        });
+        bool ok = lua.newFunc(R"==(
+            local objs = {}
+            for i = 1, 20 do objs[i] = Wide(i) end
+            for i = 1, 20 do
+                assert(check(objs[i]) and objs[i]:sum() == 8 * i)
+            end
+            return true
+        )==")();
+        BOOST_CHECK(ok);
+        BOOST_CHECK_EQUAL(WideLanes::live, 21);
+        // the plain userdata has the __gc newUserData set
+        lua_gc(lua.ptr(), LUA_GCCOLLECT, 0);
+        BOOST_CHECK_EQUAL(WideLanes::live, 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( nested_attribute_references )
+{
+    struct Point3 {
+        double x = 0, y = 0, z = 0;
+        double norm2() const { return x * x + y * y + z * z; }
+        void reset() { x = y = z = 0; }
+    };
+    struct Body {
+        Point3 pos, origin;
+        std::string tag = "body";
+        Body() { origin.x = 1; }
+    };
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        lua["Point3"] = Table(std::move(lua.class_<Point3>("Point3")
+            .def("norm2", &Point3::norm2)
+            .def("reset", &Point3::reset)
+            .attribute("x", &Point3::x)
+            .attribute("y", &Point3::y)));
+        lua["Body"] = Table(std::move(lua.class_<Body>("Body")
+            .init<>()
+            .attribute("pos", &Body::pos)
+            .attribute("origin", &Body::origin, Class_<Body>::Read)
+            .attribute("tag", &Body::tag)));
+    }
+    bool ok = lua.newFunc(R"==(
+        local b = Body()
+        for i = 1, 10 do b.pos.x = b.pos.x + 1 end
+        b.pos.y = 2
+        assert(b.pos.x == 10 and b.pos:norm2() == 104)
+        b.pos:reset()
+        assert(b.pos.x == 0)
+
+        -- one reference per parent and attribute, reads allocate nothing
+        assert(rawequal(b.pos, b.pos) and not rawequal(b.pos, b.origin))
+        local function read(n) for i = 1, n do local x = b.pos.x end end
+        read(1)
+        collectgarbage()
+        collectgarbage("stop")
+        local before = collectgarbage("count")
+        read(10000)
+        assert(collectgarbage("count") - before < 4)
+        collectgarbage("restart")
+
+        -- read only attribute: const methods only, no writes
+        assert(b.origin.x == 1 and b.origin:norm2() == 1)
+        assert(not pcall(function() b.origin.x = 5 end))
+        assert(not pcall(function() b.origin:reset() end))
+        assert(b.origin.x == 1)
+
+        -- the reference keeps its parent alive
+        local p = Body().pos
+        collectgarbage()
+        collectgarbage()
+        p.x = 3
+        return p.x == 3 and b.tag == "body"
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+// pushed as a number, never bound as a class
+struct Celsius {
+    double degrees;
+};
+
+namespace luamm {
+template<>
+struct VarProxy<Celsius> : VarBase {
+    bool push(const Celsius& c) {
+        lua_pushnumber(state, c.degrees);
+        return true;
+    }
+};
+}
+
+BOOST_AUTO_TEST_CASE( unbound_attribute_by_value )
+{
+    struct Room {
+        Celsius temperature{21.5};
+    };
+    TestLuaState lua;
+    lua.openlibs();
+    {
+        auto scope = lua.newScope();
+        lua["Room"] = Table(std::move(lua.class_<Room>("Room")
+            .init<>()
+            .attribute("temperature", &Room::temperature,
+                       Class_<Room>::Read)));
+    }
+    bool ok = lua.newFunc(R"==(
+        local r = Room()
+        return r.temperature == 21.5 and r:get_temperature() == 21.5
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+BOOST_AUTO_TEST_CASE( sandbox_environments )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    SandboxBase base(lua.ptr());
+    base.set("limit", 10);
+    {
+        auto scope = lua.newScope();
+        Table config = lua.newFunc(R"==(
+            local c = {limits = {max = 5}, servers = {"a.example", "b.example"}}
+            c.self = c
+            return c
+        )==")();
+        base.set("config", config);
+    }
+    Sandbox a(base), b(base);
+
+    {
+        auto scope = lua.newScope();
+        Closure fn = lua.newFunc(R"==(
+            counter = (counter or 0) + 1
+            local ok = pcall(function() string.upper = nil end)
+            return counter * limit + (ok and 1000 or 0)
+                   + (io and 100 or 0) + (_G == _ENV and 0 or 10000)
+        )==");
+        EnvSlot env(fn);
+        for (int i = 0; i < 3; i++) {
+            env.set(fn, a);
+            int r = fn();
+            BOOST_CHECK_EQUAL(r, (i + 1) * 10);
+        }
+        b.apply(fn);
+        int r = fn();
+        BOOST_CHECK_EQUAL(r, 10);
+    }
+
+    bool ok = lua.newFunc(R"==(
+        return counter == nil and string.upper("x") == "X"
+    )==")();
+    BOOST_CHECK(ok);
+
+    a.reset();
+    auto scope = lua.newScope();
+    Closure fn = lua.newFunc("return counter == nil and limit == 10");
+    a.apply(fn);
+    bool clean = fn();
+    BOOST_CHECK(clean);
+
+    // nested tables are read-only too, cycles keep their shape
+    Closure nested = lua.newFunc(R"==(
+        local ok = pcall(function() config.limits.max = 0 end)
+        return not ok and config.limits.max == 5
+               and config.self.limits == config.limits
+    )==");
+    a.apply(nested);
+    bool readonly = nested();
+    BOOST_CHECK(readonly);
+
+    // the table library cannot write raw into the shared proxies
+    Closure writer = lua.newFunc(R"==(
+        pcall(table.insert, config.servers, 1, "evil.example")
+        pcall(rawset, config.servers, 1, "evil.example")
+    )==");
+    Closure reader = lua.newFunc(R"==(
+        local n = 0
+        for _, v in ipairs(config.servers) do n = n + 1 end
+        for k in pairs(config) do n = n + 1 end
+        return config.servers[1] == "a.example" and #config.servers == 2
+               and n == 5
+    )==");
+    a.apply(writer);
+    b.apply(reader);
+    writer();
+    bool isolated = reader();
+    BOOST_CHECK(isolated);
+}
+
+static int lazyLoads = 0;
+
+static int openLazyModule(lua_State* st)
+{
+    lazyLoads++;
+    State state(st);
+    Table mod = state.newTable();
+    mod["answer"] = 42;
+    LUAMM_MODULE_RETURN(state, mod);
+}
+
+// reads its arguments like the LUAMM_MODULE demos, the file is optional
+static int openNamedModule(lua_State* L)
+{
+    State st(L);
+    st.allocate(1);
+    std::string modname = st[2];
+    std::string modfile = st[3].isstr() ? st[3] : std::string("none");
+    Table mod = st.newTable();
+    mod["name"] = modname;
+    mod["file"] = modfile;
+    LUAMM_MODULE_RETURN(st, mod);
+}
+
+BOOST_AUTO_TEST_CASE( lazy_modules_and_selective_libs )
+{
+    TestLuaState lua;
+    lua.openlib("_G");
+    lua.openlib("string");
+    BOOST_CHECK_THROW(lua.openlib("sockets"), RuntimeError);
+
+    // a strict mode __index of its own keeps working
+    bool ok = lua.newFunc(R"==(
+        setmetatable(_G, {__index = function(t, k) return "strict " .. k end})
+        return io == "strict io" and string.rep("a", 2) == "aa"
+    )==")();
+    BOOST_CHECK(ok);
+
+    lazyLoads = 0;
+    lua.lazy("answers", openLazyModule);
+    ok = lua.newFunc(R"==(
+        assert(rawget(_G, "answers") == nil)
+        assert(answers.answer == 42 and answers.answer == 42)
+        return rawget(_G, "answers") ~= nil and other == "strict other"
+    )==")();
+    BOOST_CHECK(ok);
+    BOOST_CHECK_EQUAL(lazyLoads, 1);
+
+    // preloaded modules come from require, loaded once with lazy globals
+    lua.preload("answers2", openLazyModule);
+    lua.lazy("answers3", openLazyModule);
+    ok = lua.newFunc(R"==(
+        local a = require("answers2")
+        local b = require("answers3")
+        return a.answer == 42 and b == answers3
+    )==")();
+    BOOST_CHECK(ok);
+    BOOST_CHECK_EQUAL(lazyLoads, 3);
+
+    // a replaced metatable drops the hook until the next lazy()
+    lua.lazy("pending", openLazyModule);
+    ok = lua.newFunc(R"==(
+        setmetatable(_G, {__index = function(t, k) return "new " .. k end})
+        return pending == "new pending"
+    )==")();
+    BOOST_CHECK(ok);
+    lua.lazy("later", openLazyModule);
+    ok = lua.newFunc(R"==(
+        return pending.answer == 42 and later.answer == 42
+               and other == "new other"
+    )==")();
+    BOOST_CHECK(ok);
+    BOOST_CHECK_EQUAL(lazyLoads, 5);
+
+    // loaders get only the name from lazy() and package.preload
+    lua.lazy("named", openNamedModule);
+    lua.preload("named2", openNamedModule);
+    ok = lua.newFunc(R"==(
+        local b = require("named2")
+        return named.name == "named" and named.file == "none"
+               and b.name == "named2" and b.file == "none"
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+BOOST_AUTO_TEST_CASE( class_tags_need_the_class_metatable )
+{
+    struct Target { int v = 7; };
+    struct Forged { detail::ClassTag tag; };
+    TestLuaState lua;
+    lua.openlibs();
+    auto scope = lua.newScope();
+    lua["Target"] = Table(std::move(lua.class_<Target>("Target")
+        .init<>()
+        .def("get", [](Target& t) { return t.v; })));
+    Target victim;
+    // a plain userdata ending with the bytes of a valid tag
+    UserData forged = lua.newUserData<Forged>(Forged{detail::ClassTag{
+        detail::ClassId<Target>::id(), &victim, nullptr,
+        detail::Holding::Value}});
+    BOOST_CHECK(detail::classTag(lua.ptr(), forged.index) == nullptr);
+    lua["forged"] = forged;
+    bool ok = lua.newFunc(R"==(
+        return Target():get() == 7 and not pcall(Target().get, forged)
+    )==")();
+    BOOST_CHECK(ok);
+}
+
+BOOST_AUTO_TEST_CASE( class_name_from_first_binding )
+{
+    struct Probe {};
+    TestLuaState a, b;
+    a.class_<Probe>("Probe").init();
+    b.class_<Probe>("Renamed").init();
+    BOOST_CHECK_EQUAL(detail::ClassId<Probe>::name(), "Probe");
+}
+
+#ifdef LUAMM_CALL_STATS
+BOOST_AUTO_TEST_CASE( call_statistics )
+{
+    struct Meter {
+        int total;
+        Meter(int initial) : total(initial) {}
+        void add(int i) { total += i; }
+    };
+    TestLuaState lua;
+    lua.openlibs();
+    callstats::reset();
+    {
+        auto scope = lua.newScope();
+        lua["Meter"] = Table(std::move(lua.class_<Meter>("Meter")
+            .init<int>()
+            .def("add", &Meter::add)));
+    }
+    lua["fail"] = lua.newCallable("fail", [](int i) -> int {
+        throw std::runtime_error("fail");
+    });
+    lua["callstats"] = CClosure(callstats::luaSnapshot);
+    lua.newFunc(R"==(
+        local c = Meter(1)
+        for i = 1, 10 do c:add(i) end
+        pcall(fail, 1)
+        pcall(fail, "x")
+        local stats = callstats()
+        calls = stats['Meter.add'].calls
+    )==")();
+
+    auto stats = callstats::snapshot();
+    auto find = [&stats](const string& name) {
+        for (auto& s : stats) { if (s.name == name) return s; }
+        BOOST_FAIL("no statistics for " + name);
+        return stats.front();
+    };
+    auto add = find("Meter.add");
+    BOOST_CHECK_EQUAL(add.calls, 10u);
+    BOOST_CHECK_EQUAL(add.errors, 0u);
+    BOOST_CHECK_LE(add.p50_ns, add.p99_ns);
+    BOOST_CHECK_LE(add.p99_ns, add.max_ns);
+    BOOST_CHECK_EQUAL(find("Meter.new").calls, 1u);
+    BOOST_CHECK_EQUAL(find("fail").calls, 2u);
+    BOOST_CHECK_EQUAL(find("fail").errors, 2u);
+
+    lua_Number calls = lua["calls"];
+    BOOST_CHECK_EQUAL(calls, 10);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( execution_budget )
+{
+    TestLuaState lua;
+    lua.openlibs();
+    auto spin = lua.newFunc(R"==(
+        -- a pcall inside the script must not swallow the budget error
+        while true do pcall(function() while true do end end) end
+    )==");
+    {
+        Budget budget(lua.ptr(), 100000);
+        try {
+            spin.call().call(0);
+            BOOST_FAIL("runaway loop was not stopped");
+        } catch (BudgetExceeded& e) {
+            BOOST_CHECK_EQUAL(e.reason, BudgetExceeded::Instructions);
+        }
+        BOOST_CHECK(budget.exceeded());
+    }
+    {
+        Budget budget(lua.ptr(), 0, std::chrono::milliseconds(5));
+        BOOST_CHECK_THROW(spin.call().call(0), BudgetExceeded);
+    }
+    {
+        // a batch stopped by the budget reports it as such
+        auto scope = lua.newScope();
+        Closure fn = lua.newFunc(R"==(
+            return function(x) while x > 1 do end return x end
+        )==")();
+        std::vector<Number> xs = {1, 1, 2}, out;
+        Budget budget(lua.ptr(), 100000);
+        try {
+            fn.map<Number>(xs.begin(), xs.end(), std::back_inserter(out));
+            BOOST_FAIL("runaway batch was not stopped");
+        } catch (BudgetExceeded& e) {
+            BOOST_CHECK_EQUAL(e.reason, BudgetExceeded::Instructions);
+            BOOST_CHECK(string(e.what()).find("batch item 2") == 0);
+        }
+        BOOST_CHECK_EQUAL(out.size(), 2u);
+    }
+    // the state is reusable and unlimited again
+    BOOST_CHECK(lua_gethook(lua.ptr()) == nullptr);
+    lua.newFunc("x = 0; for i = 1, 200000 do x = x + 1 end")();
+    int x = lua["x"];
+    BOOST_CHECK_EQUAL(x, 200000);
+    {
+        // ordinary errors stay RuntimeError
+        Budget budget(lua.ptr(), 100000);
+        try {
+            lua.newFunc("error('boom')").call().call(0);
+        } catch (BudgetExceeded&) {
+            BOOST_FAIL("not a budget error");
+        } catch (RuntimeError&) {}
+    }
+}